@@ -0,0 +1,137 @@
+/* Escape parameter formatting: convertnum() against the reverse-and-swap
+ * loop it replaced, on its own and across full-colour repaints of a
+ * pseudo-terminal.
+ *
+ * usage: format_bench [width height frames]
+ */
+#include "termbox.h"
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+
+#include "itoa.inl"
+
+static int convertnum_reverse(uint32_t num, char *buf) {
+  int i, l = 0;
+  int ch;
+  do {
+    buf[l++] = '0' + (num % 10);
+    num /= 10;
+  } while (num);
+  for (i = 0; i < l / 2; i++) {
+    ch = buf[i];
+    buf[i] = buf[l - 1 - i];
+    buf[l - 1 - i] = ch;
+  }
+  return l;
+}
+
+static double now_ms() {
+  using namespace std::chrono;
+  return duration<double, std::milli>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* formats the parameters of 'rounds' screens of cursor positions, the
+ * values most escapes carry */
+template <int (*F)(uint32_t, char *)>
+static double format_screens(int w, int h, int rounds, uint64_t *sum) {
+  char buf[16];
+  const double start = now_ms();
+  for (int r = 0; r < rounds; r++) {
+    for (int y = 1; y <= h; y++) {
+      for (int x = 1; x <= w; x++) {
+        *sum += F(y, buf) + buf[0];
+        *sum += F(x, buf) + buf[0];
+      }
+    }
+  }
+  return now_ms() - start;
+}
+
+static int check_range() {
+  char a[16], b[16];
+  for (uint32_t n = 0; n <= 1000000; n++) {
+    const int la = convertnum(n, a), lb = convertnum_reverse(n, b);
+    if (la != lb || memcmp(a, b, la)) {
+      fprintf(stderr, "mismatch at %u\n", n);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+static int master_fd;
+static std::atomic<uint64_t> received{0};
+
+static void drain() {
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(master_fd, buf, sizeof(buf))) > 0)
+    received += n;
+}
+
+int main(int argc, char **argv) {
+  const int w = argc > 3 ? atoi(argv[1]) : 200;
+  const int h = argc > 3 ? atoi(argv[2]) : 60;
+  const int frames = argc > 3 ? atoi(argv[3]) : 200;
+
+  if (check_range() < 0)
+    return 1;
+
+  uint64_t sum = 0;
+  const int rounds = 200;
+  const double t_rev =
+      format_screens<convertnum_reverse>(w, h, rounds, &sum);
+  const double t_new = format_screens<convertnum>(w, h, rounds, &sum);
+  const double n = 2.0 * w * h * rounds;
+  printf("format   reverse %6.2f ns  pairs %6.2f ns  per number (%llu)\n",
+         t_rev * 1e6 / n, t_new * 1e6 / n, (unsigned long long)sum % 10);
+
+  master_fd = posix_openpt(O_RDWR | O_NOCTTY);
+  if (master_fd < 0 || grantpt(master_fd) < 0 || unlockpt(master_fd) < 0) {
+    perror("posix_openpt");
+    return 1;
+  }
+  const int slave = open(ptsname(master_fd), O_RDWR | O_NOCTTY);
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_col = w;
+  ws.ws_row = h;
+  ioctl(slave, TIOCSWINSZ, &ws);
+  std::thread reader(drain);
+  reader.detach();
+
+  double spent = 0;
+  uint64_t sent = 0;
+  {
+    termbox11 tb(slave);
+    tb.select_output_mode(output_mode::mode256);
+    uint32_t seed = 1;
+    const uint64_t before = received;
+    for (int f = 0; f < frames; f++) {
+      for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+          seed = seed * 1103515245 + 12345;
+          tb_change_cell(x, y, 'a' + (seed >> 8) % 26, (seed >> 16) & 0xFF,
+                         (seed >> 24) & 0xFF);
+        }
+      }
+      const double start = now_ms();
+      tb.present();
+      spent += now_ms() - start;
+    }
+    sent = received - before;
+  }
+  printf("repaint  %dx%d mode256  %.3f ms per frame  %.1f KiB per frame\n",
+         w, h, spent / frames, sent / 1024.0 / frames);
+  fflush(stdout);
+  _exit(0);
+}
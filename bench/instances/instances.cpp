@@ -0,0 +1,196 @@
+/* Independent instances: 1, 2, 4... up to 'instances' sessions, each on a
+ * pseudo-terminal of its own and driven from a thread of its own, repainting
+ * at the same time. Reports the frames sent per second by all of them,
+ * checks that what every terminal received shows its instance's last frame,
+ * through the screen model of tests/screen/vt.h, and that a resize reaches
+ * every session.
+ *
+ * usage: instances_bench [instances width height frames]
+ */
+#include "termbox.h"
+#include "vt.h"
+#include <atomic>
+#include <chrono>
+#include <fcntl.h>
+#include <mutex>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+struct session {
+  int master;
+  int slave;
+  std::atomic<bool> done{false};
+  std::atomic<uint64_t> received{0};
+  /* what was read, kept for check_output() */
+  std::mutex lock;
+  std::string bytes;
+  std::thread reader;
+};
+
+static double now_ms() {
+  using namespace std::chrono;
+  return duration<double, std::milli>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+static void set_size(int fd, int w, int h) {
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_col = w;
+  ws.ws_row = h;
+  ioctl(fd, TIOCSWINSZ, &ws);
+}
+
+static void drain(struct session *s) {
+  char buf[1 << 16];
+  while (!s->done) {
+    ssize_t n;
+    {
+      std::lock_guard<std::mutex> lock(s->lock);
+      n = read(s->master, buf, sizeof(buf));
+      if (n > 0)
+        s->bytes.append(buf, n);
+    }
+    if (n > 0)
+      s->received += n;
+    else
+      usleep(1000);
+  }
+}
+
+static int session_open(struct session *s, int w, int h) {
+  s->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+  if (s->master < 0 || grantpt(s->master) < 0 || unlockpt(s->master) < 0)
+    return -1;
+  s->slave = open(ptsname(s->master), O_RDWR | O_NOCTTY);
+  if (s->slave < 0)
+    return -1;
+  set_size(s->slave, w, h);
+  s->reader = std::thread(drain, s);
+  return 0;
+}
+
+static void session_close(struct session *s) {
+  s->done = true;
+  s->reader.join();
+  close(s->master);
+}
+
+/* repaints 'frames' full screens of 'tb', different for every instance */
+static void repaint(termbox11 *tb, int index, int frames) {
+  const int w = tb->width(), h = tb->height();
+  uint32_t seed = index + 1;
+  for (int f = 0; f < frames; f++) {
+    for (int y = 0; y < h; y++) {
+      for (int x = 0; x < w; x++) {
+        seed = seed * 1103515245 + 12345;
+        tb->change_cell(x, y, 'a' + (seed >> 8) % 26, (seed >> 16) % 8 + 1,
+                        (seed >> 24) % 8 + 1);
+      }
+    }
+    tb->present();
+  }
+}
+
+/* whether the screen model fed all that the terminal of 'tb' received
+ * shows its back buffer */
+static bool check_output(termbox11 *tb, struct session *s, int w, int h) {
+  std::lock_guard<std::mutex> lock(s->lock);
+  char buf[1 << 16];
+  ssize_t n;
+  while ((n = read(s->master, buf, sizeof(buf))) > 0)
+    s->bytes.append(buf, n);
+  struct vt m(w, h);
+  m.feed(s->bytes);
+  s->bytes.clear();
+
+  const struct tb_cell *cells = tb->cell_buffer();
+  if (!m.errors.empty() || tb->width() != w || tb->height() != h)
+    return false;
+  for (int i = 0; i < w * h; i++) {
+    const struct vt_cell &v = m.grid[i];
+    if (v.ch != cells[i].ch || v.fg != (cells[i].fg & 0x0F) ||
+        v.bg != (cells[i].bg & 0x0F))
+      return false;
+  }
+  return true;
+}
+
+/* whether every instance sees the resize of its own terminal */
+static bool check_resize(std::vector<termbox11 *> &tbs,
+                         std::vector<struct session *> &ss, int w, int h) {
+  for (size_t i = 0; i < ss.size(); i++)
+    set_size(ss[i]->slave, w - (int)i % 7, h - (int)i % 5);
+  raise(SIGWINCH);
+  for (size_t i = 0; i < tbs.size(); i++) {
+    struct tb_event ev;
+    if (tbs[i]->peek_event(&ev, 1000) != event_type::resize ||
+        ev.w != w - (int)i % 7 || ev.h != h - (int)i % 5)
+      return false;
+    tbs[i]->clear();
+    tbs[i]->present();
+  }
+  return true;
+}
+
+int main(int argc, char **argv) {
+  const int most = argc > 4 ? atoi(argv[1]) : 8;
+  const int w = argc > 4 ? atoi(argv[2]) : 120;
+  const int h = argc > 4 ? atoi(argv[3]) : 40;
+  const int frames = argc > 4 ? atoi(argv[4]) : 100;
+
+  /* the screen model knows the sequences of xterm */
+  setenv("TERM", "xterm", 1);
+
+  for (int n = 1; n <= most; n *= 2) {
+    std::vector<struct session *> ss;
+    std::vector<termbox11 *> tbs;
+    for (int i = 0; i < n; i++) {
+      struct session *s = new session;
+      if (session_open(s, w, h) < 0) {
+        perror("posix_openpt");
+        return 1;
+      }
+      ss.push_back(s);
+      tbs.push_back(new termbox11(s->slave));
+    }
+
+    const double start = now_ms();
+    std::vector<std::thread> threads;
+    for (int i = 0; i < n; i++)
+      threads.emplace_back(repaint, tbs[i], i, frames);
+    for (auto &t : threads)
+      t.join();
+    const double spent = now_ms() - start;
+
+    uint64_t sent = 0;
+    for (auto s : ss)
+      sent += s->received;
+    bool drawn = true;
+    for (int i = 0; i < n; i++)
+      drawn = check_output(tbs[i], ss[i], w, h) && drawn;
+    const bool resized = check_resize(tbs, ss, w, h);
+    printf("%3d instances  %8.1f frames/s  %7.1f MiB/s  output %s  resize "
+           "%s\n",
+           n, n * frames * 1000.0 / spent, sent / 1048576.0 * 1000.0 / spent,
+           drawn ? "ok" : "FAILED", resized ? "ok" : "FAILED");
+    fflush(stdout);
+
+    for (int i = 0; i < n; i++) {
+      delete tbs[i];
+      session_close(ss[i]);
+      delete ss[i];
+    }
+    if (!drawn || !resized)
+      return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,286 @@
+/* The render and input hot paths on standard workloads, run against a
+ * headless instance so that no terminal is in the measurement: present()
+ * on full repaints, sparse 1% updates to a blank screen and to one full of
+ * text, a scrolling log, a colour gradient, wide CJK text and a resize
+ * storm, and event extraction from recorded key, mouse and paste streams.
+ * Reports time, bytes and heap allocations per frame or event as JSON, for
+ * tracking regressions. The allocations are counted on glibc only, and are
+ * null elsewhere.
+ *
+ * usage: termbox11_bench [width height frames]
+ */
+#include "termbox.h"
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+/* every allocation of the process is counted, libstdc++ and the library
+ * included, by taking over malloc() */
+static std::atomic<uint64_t> allocations{0};
+
+#ifdef __GLIBC__
+#define COUNT_ALLOCATIONS 1
+
+extern "C" {
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t n, size_t size);
+void *__libc_realloc(void *p, size_t size);
+
+void *malloc(size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_malloc(size);
+}
+
+void *calloc(size_t n, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t size) {
+  allocations.fetch_add(1, std::memory_order_relaxed);
+  return __libc_realloc(p, size);
+}
+}
+#else
+#define COUNT_ALLOCATIONS 0
+#endif
+
+static uint64_t now_ns() {
+  using namespace std::chrono;
+  return duration_cast<nanoseconds>(steady_clock::now().time_since_epoch())
+      .count();
+}
+
+/* prints the field 'key' as 'total' per 'n' with 'decimals', or as null
+ * if there is nothing to divide by */
+static void print_per(const char *key, double total, uint64_t n,
+                      int decimals) {
+  if (n)
+    printf(", \"%s\": %.*f", key, decimals, total / n);
+  else
+    printf(", \"%s\": null", key);
+}
+
+static uint32_t seed = 1;
+
+static uint32_t next() {
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+struct workload {
+  const char *name;
+  void (*draw)(termbox11 &tb, int f);
+  /* draws what is on the screen before the first frame, untimed */
+  void (*setup)(termbox11 &tb);
+};
+
+static void full_repaint(termbox11 &tb, int) {
+  const int w = tb.width(), h = tb.height();
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      const uint32_t r = next();
+      tb.change_cell(x, y, 'a' + r % 26, (r >> 5) % 8 + 1, (r >> 9) % 8 + 1);
+    }
+}
+
+static void sparse(termbox11 &tb, int) {
+  const int w = tb.width(), h = tb.height();
+  for (int k = 0; k < w * h / 100; k++) {
+    const uint32_t r = next();
+    tb.change_cell(r % w, (r >> 8) % h, 'a' + (r >> 4) % 26, r % 8 + 1, 0);
+  }
+}
+
+/* a screen full of text, as in an editor or a dashboard */
+static void text_screen(termbox11 &tb) {
+  const int w = tb.width(), h = tb.height();
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++) {
+      const uint32_t r = next();
+      tb.change_cell(x, y, r % 5 ? 'a' + r % 26 : ' ', (r >> 5) % 8 + 1, 0);
+    }
+}
+
+/* a log scrolling up a line per frame above a fixed status line */
+static void scrolling_log(termbox11 &tb, int f) {
+  const int w = tb.width(), h = tb.height();
+  struct tb_cell *c = tb.cell_buffer();
+  memmove(c, c + w, sizeof(struct tb_cell) * w * (h - 2));
+  const int len = next() % w;
+  for (int x = 0; x < w; x++)
+    c[(h - 2) * w + x] = {(uint32_t)(x < len ? 'a' + next() % 26 : ' '),
+                          (uint16_t)(x < 8 ? TB_YELLOW : TB_DEFAULT), 0};
+  for (int x = 0; x < w; x++)
+    c[(h - 1) * w + x] = {(uint32_t)('0' + (f + x) % 10), TB_WHITE, TB_BLUE};
+  tb.mark_dirty(0, h);
+}
+
+/* 256 colours drifting across the screen */
+static void gradient(termbox11 &tb, int f) {
+  const int w = tb.width(), h = tb.height();
+  for (int y = 0; y < h; y++)
+    for (int x = 0; x < w; x++)
+      tb.change_cell(x, y, ' ', 0, 16 + (x + f + y / 4 * 36) % 216);
+}
+
+/* CJK text, a tenth of the lines rewritten per frame */
+static void wide_cjk(termbox11 &tb, int f) {
+  const int w = tb.width(), h = tb.height();
+  for (int y = f % 10; y < h; y += 10)
+    for (int x = 0; x + 1 < w; x += 2)
+      tb.change_cell(x, y, 0x4e00 + next() % 0x5000, TB_WHITE, TB_DEFAULT);
+}
+
+/* the size resize_storm() starts from, see storm_start() */
+static int storm_w, storm_h;
+
+static void storm_start(termbox11 &tb) {
+  storm_w = tb.width();
+  storm_h = tb.height();
+}
+
+/* a different size every frame, as while a window is dragged */
+static void resize_storm(termbox11 &tb, int f) {
+  tb.resize(storm_w - f % 17, storm_h - f % 7);
+  struct tb_event ev;
+  tb.peek_event(&ev, 0);
+  tb.clear();
+  full_repaint(tb, f);
+}
+
+static const struct workload workloads[] = {
+    {"full_repaint", full_repaint, nullptr},
+    {"sparse_1pct", sparse, nullptr},
+    {"sparse_text_1pct", sparse, text_screen},
+    {"scrolling_log", scrolling_log, nullptr},
+    {"gradient_256", gradient, nullptr},
+    {"wide_cjk", wide_cjk, nullptr},
+    {"resize_storm", resize_storm, storm_start},
+};
+
+static void run_present(const struct workload &wl, int w, int h,
+                        int frames) {
+  uint64_t bytes = 0;
+  headless_io io;
+  io.width = w;
+  io.height = h;
+  io.output = [&bytes](const char *, std::size_t len) { bytes += len; };
+  termbox11 tb(io);
+  if (wl.draw == gradient)
+    tb.select_output_mode(output_mode::mode256);
+  seed = 1;
+  if (wl.setup)
+    wl.setup(tb);
+  tb.present();
+
+  seed = 1;
+  uint64_t spent = 0, allocs = 0;
+  bytes = 0;
+  for (int f = 0; f < frames; f++) {
+    wl.draw(tb, f);
+    const uint64_t a = allocations, start = now_ns();
+    tb.present();
+    spent += now_ns() - start;
+    allocs += allocations - a;
+  }
+  printf("    {\"name\": \"%s\", \"frames\": %d", wl.name, frames);
+  print_per("ns_per_frame", spent, frames, 0);
+  print_per("bytes_per_frame", bytes, frames, 1);
+  print_per("allocs_per_frame", allocs, COUNT_ALLOCATIONS ? frames : 0, 2);
+  printf("}");
+}
+
+/* typing with arrows, function keys and escape */
+static std::string key_stream(size_t size) {
+  static const char *const keys[] = {"\033OA", "\033OB", "\033OC", "\033OD",
+                                     "\033[5~", "\033[6~", "\033OP", "\r",
+                                     "\t",      "\x7f",    "\033[15~"};
+  std::string s;
+  while (s.size() < size) {
+    const uint32_t r = next();
+    if (r % 4 == 0)
+      s += keys[(r >> 4) % 11];
+    else
+      s += (char)('a' + (r >> 4) % 26);
+  }
+  return s;
+}
+
+/* SGR 1006 motion and clicks with a wheel now and then */
+static std::string mouse_stream(size_t size) {
+  std::string s;
+  char buf[32];
+  while (s.size() < size) {
+    const uint32_t r = next();
+    const int b = r % 8 == 0 ? 64 + r % 2 : r % 3 == 0 ? 0 : 32;
+    snprintf(buf, sizeof(buf), "\033[<%d;%u;%u%c", b, (r >> 4) % 200 + 1,
+             (r >> 12) % 60 + 1, r % 5 == 0 ? 'm' : 'M');
+    s += buf;
+  }
+  return s;
+}
+
+/* pasted lines of mixed ASCII and UTF-8 text */
+static std::string paste_stream(size_t size) {
+  static const char *const words[] = {"lorem ", "ipsum ", "caf\xc3\xa9 ",
+                                      "\xe4\xb8\xad\xe6\x96\x87 ", "dolor ",
+                                      "\xe2\x86\x92 "};
+  std::string s;
+  while (s.size() < size) {
+    const uint32_t r = next();
+    s += r % 12 == 0 ? "\r" : words[(r >> 4) % 6];
+  }
+  return s;
+}
+
+static void run_input(const char *name, const std::string &stream) {
+  size_t pos = 0;
+  headless_io io;
+  io.output = [](const char *, std::size_t) {};
+  io.input = [&](char *data, std::size_t len) {
+    len = std::min(len, stream.size() - pos);
+    memcpy(data, stream.data() + pos, len);
+    pos += len;
+    return (int)len;
+  };
+  termbox11 tb(io);
+  tb.select_input_mode({true, false, true});
+
+  struct tb_event ev;
+  uint64_t events = 0;
+  const uint64_t a = allocations, start = now_ns();
+  while (tb.peek_event(&ev, 0) != event_type::none)
+    events++;
+  const uint64_t spent = now_ns() - start, allocs = allocations - a;
+  printf("    {\"name\": \"%s\", \"bytes\": %zu, \"events\": %llu", name,
+         stream.size(), (unsigned long long)events);
+  print_per("ns_per_event", spent, events, 1);
+  print_per("allocs_per_event", allocs, COUNT_ALLOCATIONS ? events : 0, 4);
+  printf("}");
+}
+
+int main(int argc, char **argv) {
+  const int w = argc > 3 ? atoi(argv[1]) : 200;
+  const int h = argc > 3 ? atoi(argv[2]) : 60;
+  const int frames = argc > 3 ? atoi(argv[3]) : 200;
+
+  printf("{\n  \"width\": %d,\n  \"height\": %d,\n  \"present\": [\n", w, h);
+  for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+    run_present(workloads[i], w, h, frames);
+    printf("%s\n", i + 1 < sizeof(workloads) / sizeof(workloads[0]) ? "," : "");
+  }
+  printf("  ],\n  \"extract_event\": [\n");
+  seed = 1;
+  run_input("keys", key_stream(1 << 20));
+  printf(",\n");
+  run_input("mouse", mouse_stream(1 << 20));
+  printf(",\n");
+  run_input("paste", paste_stream(1 << 20));
+  printf("\n  ]\n}\n");
+  return 0;
+}
@@ -341,7 +341,8 @@ void print_tb(const char *str, int x, int y, uint16_t fg, uint16_t bg) {
     uint32_t uni;
     str += tb_utf8_char_to_unicode(&uni, str);
     tb_change_cell(x, y, uni, fg, bg);
-    x++;
+    int w = tb_char_width(uni);
+    x += w > 1 ? w : 1;
   }
 }
 
@@ -0,0 +1,109 @@
+#!/usr/bin/env python3
+"""Generates src/width.inl, the column width table used by tb_char_width().
+
+The table is built from the Unicode database bundled with the running Python
+interpreter, so regenerate it with a recent one when updating:
+
+    scripts/gen_width_table.py > src/width.inl
+"""
+
+import sys
+import unicodedata
+
+BLOCK = 256
+PLANES_END = 0x110000
+
+# 2-bit codes stored in the table, see char_width() in the generated file
+ZERO, ONE, TWO, CONTROL = 0, 1, 2, 3
+
+VISIBLE_FORMAT = {0xAD, 0x600, 0x601, 0x602, 0x603, 0x604, 0x605, 0x6DD, 0x70F,
+                  0x890, 0x891, 0x8E2, 0x110BD, 0x110CD}
+
+WIDE_DEFAULT = (
+    (0x3400, 0x4DBF),
+    (0x4E00, 0x9FFF),
+    (0xF900, 0xFAFF),
+    (0x20000, 0x2FFFD),
+    (0x30000, 0x3FFFD),
+)
+
+
+def width(cp):
+    if cp == 0:
+        return ZERO
+    if cp < 0x20 or 0x7F <= cp < 0xA0:
+        return CONTROL
+    c = chr(cp)
+    cat = unicodedata.category(c)
+    if cat == "Cs":
+        return CONTROL
+    # soft hyphen and the prepended concatenation marks are printed
+    if cp in VISIBLE_FORMAT:
+        return ONE
+    if cat in ("Mn", "Me", "Cf") or cp == 0x200B:
+        return ZERO
+    # hangul medial vowels and final consonants combine with the initial
+    if 0x1160 <= cp <= 0x11FF or 0xD7B0 <= cp <= 0xD7FF:
+        return ZERO
+    if cat == "Cn":
+        # the database has no width for unassigned code points, UAX #11 makes
+        # the ideographic ranges default to wide
+        for lo, hi in WIDE_DEFAULT:
+            if lo <= cp <= hi:
+                return TWO
+        return ONE
+    if unicodedata.east_asian_width(c) in ("W", "F"):
+        return TWO
+    return ONE
+
+
+def main():
+    blocks = {}
+    stage1 = []
+    for b in range(PLANES_END // BLOCK):
+        packed = bytearray(BLOCK // 4)
+        for i in range(BLOCK):
+            packed[i // 4] |= width(b * BLOCK + i) << ((i % 4) * 2)
+        stage1.append(blocks.setdefault(bytes(packed), len(blocks)))
+    assert len(blocks) <= 256
+
+    out = sys.stdout
+    out.write("// Generated by scripts/gen_width_table.py from Unicode %s, "
+              "do not edit.\n" % unicodedata.unidata_version)
+    out.write("//\n"
+              "// Terminal column widths of all code points, looked up in "
+              "two stages: the\n"
+              "// high bits select one of the distinct 256 code point blocks "
+              "and the block\n"
+              "// holds a 2-bit code per code point (0, 1, 2 columns or 3 "
+              "for controls).\n\n")
+
+    out.write("static constexpr uint8_t width_stage1[%d] = {\n" % len(stage1))
+    for i in range(0, len(stage1), 16):
+        row = ", ".join("%d" % v for v in stage1[i:i + 16])
+        out.write("\t%s,\n" % row)
+    out.write("};\n\n")
+
+    out.write("static constexpr uint8_t width_stage2[%d][%d] = {\n"
+              % (len(blocks), BLOCK // 4))
+    for packed in sorted(blocks, key=blocks.get):
+        out.write("\t{\n")
+        for i in range(0, len(packed), 12):
+            row = ", ".join("0x%02x" % v for v in packed[i:i + 12])
+            out.write("\t\t%s,\n" % row)
+        out.write("\t},\n")
+    out.write("};\n\n")
+
+    out.write("""static constexpr int char_width(uint32_t ch)
+{
+	if (ch >= 0x%X)
+		return -1;
+	const unsigned code = (width_stage2[width_stage1[ch >> 8]][(ch & 0xFF) >> 2]
+			       >> ((ch & 3) * 2)) & 3;
+	return code == 3 ? -1 : (int)code;
+}
+""" % PLANES_END)
+
+
+if __name__ == "__main__":
+    main()
@@ -54,11 +54,6 @@ static void bytebuffer_resize(struct bytebuffer *b, int len) {
 	b->len = len;
 }
 
-static void bytebuffer_flush(struct bytebuffer *b, int fd) {
-	write(fd, b->buf, b->len);
-	bytebuffer_clear(b);
-}
-
 static void bytebuffer_truncate(struct bytebuffer *b, int n) {
 	if (n <= 0)
 		return;
@@ -68,3 +63,59 @@ static void bytebuffer_truncate(struct bytebuffer *b, int n) {
 	memmove(b->buf, b->buf+n, nmove);
 	b->len -= n;
 }
+
+// what the writes of a flush took, counted by the flushes given one
+struct iostats {
+	uint64_t bytes;
+	uint64_t writes;
+	uint64_t short_writes; // those which took less than they were given
+};
+
+static inline void iostats_count(struct iostats *st, ssize_t r, size_t len) {
+	if (!st)
+		return;
+	st->writes++;
+	if (r > 0)
+		st->bytes += r;
+	if (r < (ssize_t)len)
+		st->short_writes++;
+}
+
+static void bytebuffer_flush(struct bytebuffer *b, int fd,
+			     struct iostats *st) {
+	int off = 0;
+	while (off < b->len) {
+		ssize_t r = write(fd, b->buf + off, b->len - off);
+		iostats_count(st, r, b->len - off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		off += r;
+	}
+	bytebuffer_clear(b);
+}
+
+// writes as much as 'fd' takes without blocking and drops that from the
+// buffer, the rest stays for the next call. Returns -1 on errors other than
+// the fd being full, the buffer is dropped then.
+static int bytebuffer_flush_some(struct bytebuffer *b, int fd,
+				 struct iostats *st) {
+	int off = 0;
+	while (off < b->len) {
+		ssize_t r = write(fd, b->buf + off, b->len - off);
+		iostats_count(st, r, b->len - off);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			bytebuffer_clear(b);
+			return -1;
+		}
+		off += r;
+	}
+	bytebuffer_truncate(b, off);
+	return 0;
+}
@@ -0,0 +1,149 @@
+// Row diff kernels. Each of them compares 'n' cells of 'back' against 'front'
+// and writes the half-open [begin, end) ranges of differing cells to 'spans',
+// which must have room for n / 2 + 1 entries. The number of spans is
+// returned. All the variants produce exactly the same spans, the SIMD ones
+// are only faster at skipping over long runs of equal cells.
+
+struct cellspan {
+	int begin;
+	int end;
+};
+
+typedef int (*celldiff_func)(const struct tb_cell *back,
+			     const struct tb_cell *front, int n,
+			     struct cellspan *spans);
+
+// feeds the per-cell difference bits of the 'ncells' cells starting at 'x'
+// into the span list, '*open' is the start of the span being built or -1
+static inline int celldiff_push(unsigned diff, int ncells, int x, int *open,
+				struct cellspan *spans, int nspans)
+{
+	int i;
+	for (i = 0; i < ncells; i++) {
+		if (diff & (1u << i)) {
+			if (*open < 0)
+				*open = x + i;
+		} else if (*open >= 0) {
+			spans[nspans].begin = *open;
+			spans[nspans].end = x + i;
+			nspans++;
+			*open = -1;
+		}
+	}
+	return nspans;
+}
+
+static inline int celldiff_finish(int n, int open, struct cellspan *spans,
+				  int nspans)
+{
+	if (open >= 0) {
+		spans[nspans].begin = open;
+		spans[nspans].end = n;
+		nspans++;
+	}
+	return nspans;
+}
+
+static inline unsigned celldiff_cell(const struct tb_cell *a,
+				     const struct tb_cell *b)
+{
+	uint64_t x, y;
+	memcpy(&x, a, sizeof(x));
+	memcpy(&y, b, sizeof(y));
+	return x != y;
+}
+
+static int celldiff_row_scalar(const struct tb_cell *back,
+			       const struct tb_cell *front, int n,
+			       struct cellspan *spans)
+{
+	int x, open = -1, nspans = 0;
+	for (x = 0; x < n; x++)
+		nspans = celldiff_push(celldiff_cell(back + x, front + x), 1, x,
+				       &open, spans, nspans);
+	return celldiff_finish(n, open, spans, nspans);
+}
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CELLDIFF_X86
+#include <immintrin.h>
+
+static_assert(sizeof(struct tb_cell) == 8, "cell must be 64 bits wide");
+
+// SSE2 has no 64-bit compare, so compare 32-bit halves and fold the two
+// lane bits of every cell together: 2 cells per vector, 4 per iteration.
+__attribute__((target("sse2"))) static int
+celldiff_row_sse2(const struct tb_cell *back, const struct tb_cell *front,
+		  int n, struct cellspan *spans)
+{
+	int x = 0, open = -1, nspans = 0;
+	for (; x + 4 <= n; x += 4) {
+		const __m128i *b = (const __m128i *)(back + x);
+		const __m128i *f = (const __m128i *)(front + x);
+		__m128i e0 = _mm_cmpeq_epi32(_mm_loadu_si128(b),
+					     _mm_loadu_si128(f));
+		__m128i e1 = _mm_cmpeq_epi32(_mm_loadu_si128(b + 1),
+					     _mm_loadu_si128(f + 1));
+		unsigned eq0 = _mm_movemask_ps(_mm_castsi128_ps(e0));
+		unsigned eq1 = _mm_movemask_ps(_mm_castsi128_ps(e1));
+		unsigned eq = eq0 | (eq1 << 4);
+		if (eq == 0xFF && open < 0)
+			continue;
+		// cell i is equal when both of its lane bits are set
+		unsigned diff = 0;
+		diff |= (eq & 0x03) != 0x03;
+		diff |= ((eq & 0x0C) != 0x0C) << 1;
+		diff |= ((eq & 0x30) != 0x30) << 2;
+		diff |= ((eq & 0xC0) != 0xC0) << 3;
+		if (diff == 0xF && open >= 0)
+			continue;
+		nspans = celldiff_push(diff, 4, x, &open, spans, nspans);
+	}
+	for (; x < n; x++)
+		nspans = celldiff_push(celldiff_cell(back + x, front + x), 1, x,
+				       &open, spans, nspans);
+	return celldiff_finish(n, open, spans, nspans);
+}
+
+// AVX2 compares whole cells: 4 per vector, 8 per iteration.
+__attribute__((target("avx2"))) static int
+celldiff_row_avx2(const struct tb_cell *back, const struct tb_cell *front,
+		  int n, struct cellspan *spans)
+{
+	int x = 0, open = -1, nspans = 0;
+	for (; x + 8 <= n; x += 8) {
+		const __m256i *b = (const __m256i *)(back + x);
+		const __m256i *f = (const __m256i *)(front + x);
+		__m256i e0 = _mm256_cmpeq_epi64(_mm256_loadu_si256(b),
+						_mm256_loadu_si256(f));
+		__m256i e1 = _mm256_cmpeq_epi64(_mm256_loadu_si256(b + 1),
+						_mm256_loadu_si256(f + 1));
+		unsigned eq0 = _mm256_movemask_pd(_mm256_castsi256_pd(e0));
+		unsigned eq1 = _mm256_movemask_pd(_mm256_castsi256_pd(e1));
+		unsigned diff = ~(eq0 | (eq1 << 4)) & 0xFF;
+		if ((diff == 0 && open < 0) || (diff == 0xFF && open >= 0))
+			continue;
+		nspans = celldiff_push(diff, 8, x, &open, spans, nspans);
+	}
+	for (; x < n; x++)
+		nspans = celldiff_push(celldiff_cell(back + x, front + x), 1, x,
+				       &open, spans, nspans);
+	return celldiff_finish(n, open, spans, nspans);
+}
+#endif
+
+// picks the best kernel for this CPU. It is chosen while the library loads
+// rather than on first use, so the encoder threads find it settled.
+static celldiff_func celldiff_row_select(void)
+{
+#ifdef CELLDIFF_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return celldiff_row_avx2;
+	if (__builtin_cpu_supports("sse2"))
+		return celldiff_row_sse2;
+#endif
+	return celldiff_row_scalar;
+}
+
+static const celldiff_func celldiff_row = celldiff_row_select();
@@ -1,8 +1,10 @@
 #ifndef __TERMBOX_H__
 #define __TERMBOX_H__
 
-#include <string>
 #include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
 
 /* Key constants. See also struct tb_event's key field.
  *
@@ -203,6 +205,88 @@ enum class output_mode {
   grayscale
 };
 
+/* How the terminal is read and written, see termbox11(int, io_backend).
+ */
+enum class io_backend {
+  standard,
+  io_uring
+};
+
+/* What a headless termbox11 talks to instead of a terminal, see
+ * termbox11(const headless_io &).
+ */
+struct headless_io {
+  /* size of the screen, see also termbox11::resize() */
+  int width{80};
+  int height{24};
+  /* the terminal the output is meant for, looked up among those termbox
+   * knows built in (xterm, rxvt-unicode, rxvt-256color, screen, linux and
+   * Eterm, or what they are compatible with) rather than in terminfo */
+  std::string term{"xterm"};
+  /* the output goes to the end of 'buffer' if set, else to 'output' in the
+   * pieces it is written in; either way it is the byte stream a terminal
+   * would have been sent. With the render thread it arrives from that
+   * thread. */
+  std::string *buffer{nullptr};
+  std::function<void(const char *data, std::size_t len)> output;
+  /* copies up to 'len' bytes of input available right now to 'data' and
+   * returns how many, 0 if there are none and -1 on errors */
+  std::function<int(char *data, std::size_t len)> input;
+};
+
+/* Counts of the rows the encoded row cache could and could not replay, see
+ * termbox11::select_row_cache().
+ */
+struct row_cache_stats {
+  std::uint64_t hits{0};
+  std::uint64_t misses{0};
+};
+
+/* What present() did, see termbox11::last_frame_stats(). The counters are
+ * only kept when termbox11 is built with TB_STATS defined, which the
+ * TERMBOX11_STATS CMake option does, and stay 0 otherwise.
+ */
+struct frame_stats {
+  /* frames sent, several presented ones being merged into one with frame
+   * pacing or asynchronous output */
+  std::uint64_t frames{0};
+  /* cells compared with the screen, those found to differ and the runs of
+   * them the diff returned */
+  std::uint64_t cells_scanned{0};
+  std::uint64_t cells_changed{0};
+  std::uint64_t spans{0};
+  /* cursor motions and SGR sequences sent */
+  std::uint64_t cursor_moves{0};
+  std::uint64_t sgr_sequences{0};
+  /* bytes written to the terminal, the write calls and those of them which
+   * took less than they were given */
+  std::uint64_t bytes_written{0};
+  std::uint64_t writes{0};
+  std::uint64_t short_writes{0};
+  /* time spent finding changed cells and encoding them, summed over the
+   * encoder threads, and writing the output */
+  std::uint64_t diff_ns{0};
+  std::uint64_t encode_ns{0};
+  std::uint64_t flush_ns{0};
+};
+
+/* Settings of the bandwidth adaptation, see
+ * termbox11::select_adaptive_output().
+ */
+struct output_adaptation {
+  /* bytes queued for the terminal, in the tty and in termbox, past which the
+   * link counts as falling behind */
+  std::size_t max_queue{8192};
+  /* bytes a second the link has to take while output waits for it, 0 to go
+   * by the queue alone */
+  std::uint64_t min_rate{1 << 20};
+  /* how long the queue has to stay low before output is stepped back up */
+  int recover_ms{2000};
+  /* called with the output mode frames are now sent in and whether cell
+   * attributes are still sent, each time either changes */
+  std::function<void(::output_mode mode, bool attributes)> changed;
+};
+
 struct termbox_impl;
 
 class termbox11 {
@@ -210,6 +294,21 @@ public:
   termbox11();
   termbox11(std::string name);
   termbox11(int fd);
+  /* Does the I/O on 'fd' through 'backend'. io_backend::io_uring keeps a
+   * read of the terminal queued in an io_uring, so that waiting for input
+   * and reading it take one system call, and writes frames through the ring
+   * along with it. Where io_uring is not available, as on systems other
+   * than Linux, kernels before 5.11 or where it is disabled, the standard
+   * backend is used instead; io_backend() tells which one is. The render
+   * thread writes through the standard backend either way.
+   */
+  termbox11(int fd, ::io_backend backend);
+  /* Renders without a terminal, into memory or to a remote viewer: output
+   * goes to 'io.buffer' or 'io.output' and input comes from 'io.input',
+   * nothing else in the process is touched. poll_event() and peek_event()
+   * never wait but return event_type::none when no input is available.
+   */
+  explicit termbox11(const ::headless_io &io);
   ~termbox11();
 
   event_type poll_event(struct tb_event *event);
@@ -221,18 +320,129 @@ public:
   size_t width() const;
   size_t height() const;
 
+  /* Headless instances only: changes the size of the screen, the next
+   * poll_event() or peek_event() reporting it as event_type::resize like a
+   * terminal being resized. */
+  void resize(int width, int height);
+
   void set_cursor(int cx, int cy);
 
-  void select_input_mode(input_mode mode);
-  void select_output_mode(output_mode mode);
-  output_mode output_mode();
+  /* Draw into the back buffer of this instance, like the tb_* functions of
+   * the same names below do into the instance created last. Instances are
+   * independent of each other: each has its own terminal, buffers and
+   * input state, only the terminal capabilities of $TERM are loaded once
+   * and shared. Different instances may be used from different threads at
+   * the same time, one instance from one thread at a time.
+   */
+  void put_cell(int x, int y, const struct tb_cell *cell);
+  void change_cell(int x, int y, uint32_t ch, uint16_t fg, uint16_t bg);
+  void blit(int x, int y, int w, int h, const struct tb_cell *cells);
+  struct tb_cell *cell_buffer();
+  void mark_dirty(int y, int h);
+  void set_clear_attributes(uint16_t fg, uint16_t bg);
+
+  void select_input_mode(::input_mode mode);
+  void select_output_mode(::output_mode mode);
+  ::output_mode output_mode();
+
+  ::input_mode input_mode();
+
+  ::io_backend io_backend();
+
+  /* Makes present() send every frame as a synchronized update (DEC private
+   * mode 2026), which terminals supporting it show all at once instead of
+   * drawing it while it arrives. Enabling it asks the terminal whether it
+   * knows the mode; the answer is read along with the input by
+   * poll_event() and peek_event(), frames are wrapped once it came back
+   * positive. Disabled by default.
+   */
+  void select_sync_output(bool enable);
+  /* Returns true if frames are currently sent as synchronized updates. */
+  bool sync_output();
+
+  /* Switches the terminal to non-blocking output. present() and the other
+   * calls then write only what the terminal takes right away and queue the
+   * rest, which poll_event() and peek_event() send as the terminal drains.
+   * A frame presented while the previous one is still queued is not queued
+   * behind it: it waits as a whole and is replaced by any later one, so a
+   * slow terminal skips frames instead of stalling the caller. Disabling it
+   * blocks until everything queued is written. Disabled by default.
+   */
+  void select_async_output(bool enable);
+  bool async_output();
+  /* Returns true while output is queued, see select_async_output() and
+   * select_frame_rate(). */
+  bool output_pending();
+
+  /* Sends at most 'fps' frames a second. present() sends the frame right
+   * away when the last one went out at least a frame interval ago, otherwise
+   * it only takes note of it: frames presented within the interval are
+   * merged and the last of them is sent by poll_event() or peek_event() once
+   * the interval is over, so that those have to be called for it to go out.
+   * 0 disables pacing, which is the default, and sends any frame waiting.
+   */
+  void select_frame_rate(int fps);
+  int frame_rate();
+
+  /* Sends frames from a background thread. present() then only copies the
+   * back buffer and returns, the thread encodes and writes the frame while
+   * the caller goes on drawing the next one. Frames presented faster than
+   * the terminal takes them replace each other, only the latest is sent.
+   * The cursor set by set_cursor() moves along with the next frame. Cannot
+   * be combined with select_async_output(), enabling either disables the
+   * other. Disabling it waits for the last frame presented to be written.
+   * Disabled by default.
+   */
+  void select_render_thread(bool enable);
+  bool render_thread();
+
+  /* Spreads the encoding of large frames over 'n' threads: the changed rows
+   * are split into bands encoded side by side and joined in order, the
+   * output being byte for byte the same as with a single thread. Frames
+   * with few changed cells are encoded by the calling thread alone. 1 by
+   * default.
+   */
+  void select_encode_threads(int n);
+  int encode_threads();
+
+  /* Keeps the bytes sent for the last 'entries' rows redrawn, so that a row
+   * changing from and to the same content as before, for example when
+   * flipping between a few screens, is sent again without encoding it. The
+   * output is the same as without the cache. Selecting a size empties the
+   * cache and resets its counters, 0 disables it, which is the default.
+   */
+  void select_row_cache(int entries);
+  int row_cache();
+  ::row_cache_stats row_cache_stats();
+
+  /* Lowers the output to what a slow link keeps up with. Before each frame
+   * the output queued for the terminal and the rate the link takes it at
+   * are checked against 'config': past them frames are sent in normal mode,
+   * each color as the nearest of its eight, then without attributes at all,
+   * one step at a time. Once the link kept up for
+   * 'config.recover_ms' the output steps back up and the screen is redrawn
+   * in full. Each step is reported to 'config.changed' from the next
+   * present(), poll_event() or peek_event(). Disabled by default.
+   */
+  void select_adaptive_output(bool enable,
+                              const ::output_adaptation &config = {});
+  bool adaptive_output();
 
-  input_mode input_mode();
+  /* Returns the counters of the last frame sent, along with the output
+   * written since, and their totals over all frames. Only kept when built
+   * with TB_STATS, see frame_stats.
+   */
+  ::frame_stats last_frame_stats();
+  ::frame_stats total_frame_stats();
 
 private:
   std::unique_ptr<termbox_impl> _impl;
 };
 
+/* The functions below draw into the most recently created termbox11 which is
+ * still alive and do nothing when there is none. With several instances, use
+ * their member functions of the same names instead.
+ */
 
 /* Clears the internal back buffer using TB_DEFAULT color or the
  * color/attributes set by tb_set_clear_attributes() function.
@@ -264,9 +474,19 @@ void tb_blit(int x, int y, int w, int h, const struct tb_cell *cells);
  * using tb_width() and tb_height() functions. The pointer stays valid as long
  * as no tb_clear() and tb_present() calls are made. The buffer is
  * one-dimensional buffer containing lines of cells starting from the top.
+ *
+ * Writes made through this pointer are not tracked, call tb_mark_dirty() on
+ * the rows you touched before presenting.
  */
 struct tb_cell *tb_cell_buffer(void);
 
+/* Marks 'h' rows starting at row 'y' of the back buffer as modified. Only rows
+ * changed through tb_put_cell(), tb_change_cell(), tb_blit() or clear() since
+ * the last present() are compared against the screen, everything else has to
+ * be flagged with this function.
+ */
+void tb_mark_dirty(int y, int h);
+
 
 /* Utility utf8 functions. */
 #define TB_EOF -1
@@ -274,4 +494,11 @@ int tb_utf8_char_length(char c);
 int tb_utf8_char_to_unicode(uint32_t *out, const char *c);
 int tb_utf8_unicode_to_char(char *out, uint32_t c);
 
+/* Returns the number of columns the unicode character 'c' takes on the
+ * terminal: 0 for combining and other zero-width characters, 2 for East Asian
+ * wide and fullwidth ones, -1 for control characters and 1 for everything
+ * else. Unlike wcwidth() it does not depend on the current locale.
+ */
+int tb_char_width(uint32_t c);
+
 #endif // __TERMBOX_H__
@@ -137,9 +137,48 @@ static int parse_mouse_event(struct tb_event *event, const char *buf, int len) {
 	return 0;
 }
 
+// DEC private mode which makes the terminal hold back drawing until a frame is
+// complete, see termbox11::select_sync_output()
+#define SYNC_OUTPUT_MODE 2026
+#define SYNC_OUTPUT_BEGIN "\033[?2026h"
+#define SYNC_OUTPUT_END "\033[?2026l"
+#define SYNC_OUTPUT_QUERY "\033[?2026$p"
+
+// what the parser needs to know of the terminal, and learns about it
+struct input_state {
+	const char *const *keys;
+	// set once the terminal answered the query saying it knows the mode
+	bool sync_output_supported;
+};
+
+// consumes a DECRPM reply 'ESC [ ? mode ; value $ y' to one of the queries
+// termbox sends, returns the number of bytes it took or 0 if there is none
+static int parse_mode_report(struct input_state *st, const char *buf, int len)
+{
+	int i = 3, mode = 0, value = 0;
+	if (!starts_with(buf, len, "\033[?"))
+		return 0;
+	for (; i < len && buf[i] >= '0' && buf[i] <= '9'; i++)
+		mode = mode * 10 + (buf[i] - '0');
+	if (i == 3 || i >= len || buf[i++] != ';')
+		return 0;
+	for (; i < len && buf[i] >= '0' && buf[i] <= '9'; i++)
+		value = value * 10 + (buf[i] - '0');
+	if (i + 2 > len || buf[i] != '$' || buf[i + 1] != 'y')
+		return 0;
+
+	// 1 and 2 are set and reset, 3 is permanently set, 0 and 4 mean the
+	// mode cannot be used
+	if (mode == SYNC_OUTPUT_MODE)
+		st->sync_output_supported = value >= 1 && value <= 3;
+	return i + 2;
+}
+
 // convert escape sequence to event, and return consumed bytes on success (failure == 0)
-static int parse_escape_seq(struct tb_event *event, const char *buf, int len)
+static int parse_escape_seq(const struct input_state *st,
+			    struct tb_event *event, const char *buf, int len)
 {
+	const char *const *keys = st->keys;
 	int mouse_parsed = parse_mouse_event(event, buf, len);
 
 	if (mouse_parsed != 0)
@@ -149,7 +188,8 @@ static int parse_escape_seq(struct tb_event *event, const char *buf, int len)
 	// success, else return failure
 	int i;
 	for (i = 0; keys[i]; i++) {
-		if (starts_with(buf, len, keys[i])) {
+		// keys the terminal does not have are empty
+		if (*keys[i] && starts_with(buf, len, keys[i])) {
 			event->ch = 0;
 			event->key = (key_code)(0xFFFF-i);
 			return strlen(keys[i]);
@@ -158,7 +198,8 @@ static int parse_escape_seq(struct tb_event *event, const char *buf, int len)
 	return 0;
 }
 
-static bool extract_event(struct tb_event *event, struct bytebuffer *inbuf, input_mode inputmode)
+static bool extract_event(struct input_state *st, struct tb_event *event,
+			  struct bytebuffer *inbuf, input_mode inputmode)
 {
 	const char *buf = inbuf->buf;
 	const int len = inbuf->len;
@@ -166,7 +207,14 @@ static bool extract_event(struct tb_event *event, struct bytebuffer *inbuf, inpu
 		return false;
 
 	if (buf[0] == '\033') {
-		int n = parse_escape_seq(event, buf, len);
+		// replies to queries are not events
+		int n = parse_mode_report(st, buf, len);
+		if (n != 0) {
+			bytebuffer_truncate(inbuf, n);
+			return extract_event(st, event, inbuf, inputmode);
+		}
+
+		n = parse_escape_seq(st, event, buf, len);
 		if (n != 0) {
 			bool success = true;
 			if (n < 0) {
@@ -191,7 +239,7 @@ static bool extract_event(struct tb_event *event, struct bytebuffer *inbuf, inpu
 				// event and redo parsing
 				event->mod = modifiers::alt;
 				bytebuffer_truncate(inbuf, 1);
-				return extract_event(event, inbuf, inputmode);
+				return extract_event(st, event, inbuf, inputmode);
 			}
 			assert(!"never got here");
 		}
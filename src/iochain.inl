@@ -0,0 +1,130 @@
+// Output gathered from several places. A frame is mostly small escapes and
+// glyphs copied into the output buffer. Only the bands of a frame drawn by
+// the encoder threads already sit in memory which outlives the write; they
+// are referenced in place and the whole goes out with writev(), the runs of
+// the output buffer in between being referenced by offset since the buffer
+// may move as it grows. Without encoder threads a frame is copied and
+// written like before.
+
+#include <limits.h>
+#include <sys/uio.h>
+
+// references shorter than this are cheaper to copy than to give their own
+// iovec
+#define IOCHAIN_MIN_REF 256
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+struct iosegment {
+	const char *data; // NULL for a run of the output buffer
+	int off;
+	int len;
+};
+
+struct iochain {
+	struct iosegment *segs;
+	int nsegs;
+	int cap;
+	int mark; // where the run of the output buffer not referenced yet starts
+	int len; // bytes referenced in place
+};
+
+static void iochain_push(struct iochain *c, const char *data, int off, int len) {
+	if (len == 0)
+		return;
+	if (c->nsegs == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 16;
+		c->segs = (struct iosegment *)realloc(c->segs,
+						      sizeof(struct iosegment) * c->cap);
+		assert(c->segs);
+	}
+	c->segs[c->nsegs].data = data;
+	c->segs[c->nsegs].off = off;
+	c->segs[c->nsegs].len = len;
+	c->nsegs++;
+}
+
+// appends 'len' bytes at 'data' to what 'b' holds, in place if there are
+// enough of them. They have to stay untouched until iochain_flush().
+static void iochain_ref(struct iochain *c, struct bytebuffer *b,
+			const char *data, int len) {
+	if (len < IOCHAIN_MIN_REF) {
+		bytebuffer_append(b, data, len);
+		return;
+	}
+	iochain_push(c, NULL, c->mark, b->len - c->mark);
+	iochain_push(c, data, 0, len);
+	c->mark = b->len;
+	c->len += len;
+}
+
+typedef ssize_t (*iochain_writev_func)(void *ctx, int fd,
+				      const struct iovec *iov, int n);
+
+static ssize_t iochain_writev(void *ctx, int fd, const struct iovec *iov,
+			      int n) {
+	(void)ctx;
+	return writev(fd, iov, n);
+}
+
+// writes the output buffer with everything referenced in between through
+// 'wv', blocking until it is all out, and empties both. The writes are
+// counted in 'st' if given.
+static void iochain_flush_with(struct iochain *c, struct bytebuffer *b,
+			       int fd, iochain_writev_func wv, void *ctx,
+			       struct iostats *st) {
+	struct iovec iov[IOV_MAX];
+	size_t len;
+	int i, n, first = 0;
+
+	iochain_push(c, NULL, c->mark, b->len - c->mark);
+
+	while (first < c->nsegs) {
+		for (n = 0, len = 0; n < IOV_MAX && first + n < c->nsegs; n++) {
+			const struct iosegment *s = &c->segs[first + n];
+			iov[n].iov_base = (void *)(s->data ? s->data : b->buf + s->off);
+			iov[n].iov_len = s->len;
+			len += s->len;
+		}
+		ssize_t r = wv(ctx, fd, iov, n);
+		iostats_count(st, r, len);
+		if (r < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		// skip what went out, a segment written in part keeps its rest
+		for (i = 0; i < n && r >= c->segs[first].len; i++) {
+			r -= c->segs[first].len;
+			first++;
+		}
+		if (r > 0) {
+			if (c->segs[first].data)
+				c->segs[first].data += r;
+			else
+				c->segs[first].off += r;
+			c->segs[first].len -= r;
+		}
+	}
+
+	c->nsegs = 0;
+	c->mark = 0;
+	c->len = 0;
+	bytebuffer_clear(b);
+}
+
+static void iochain_flush(struct iochain *c, struct bytebuffer *b, int fd,
+			  struct iostats *st) {
+	if (c->nsegs == 0) {
+		bytebuffer_flush(b, fd, st);
+		return;
+	}
+	iochain_flush_with(c, b, fd, iochain_writev, NULL, st);
+}
+
+static void iochain_free(struct iochain *c) {
+	free(c->segs);
+	memset(c, 0, sizeof(*c));
+}
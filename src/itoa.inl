@@ -0,0 +1,47 @@
+// Decimal formatting of escape sequence parameters: coordinates, counts and
+// the like, which mostly take one to three digits. The digits are written
+// from the right two at a time, the length being known up front, instead of
+// one at a time and reversed.
+
+static const char digit_pairs[201] =
+	"0001020304050607080910111213141516171819"
+	"2021222324252627282930313233343536373839"
+	"4041424344454647484950515253545556575859"
+	"6061626364656667686970717273747576777879"
+	"8081828384858687888990919293949596979899";
+
+// number of decimal digits of 'num'
+static inline int numlen(uint32_t num) {
+	if (num < 10)
+		return 1;
+	if (num < 100)
+		return 2;
+	if (num < 1000)
+		return 3;
+	if (num < 10000)
+		return 4;
+	if (num < 100000)
+		return 5;
+	int len = 6;
+	for (num /= 1000000; num; num /= 10)
+		len++;
+	return len;
+}
+
+// writes 'num' in decimal to 'buf', which has room for 10 characters, and
+// returns the number written
+static inline int convertnum(uint32_t num, char *buf) {
+	const int len = numlen(num);
+	char *p = buf + len;
+	while (num >= 100) {
+		const uint32_t q = num / 100;
+		p -= 2;
+		memcpy(p, &digit_pairs[(num - q * 100) * 2], 2);
+		num = q;
+	}
+	if (num >= 10)
+		memcpy(p - 2, &digit_pairs[num * 2], 2);
+	else
+		p[-1] = '0' + num;
+	return len;
+}
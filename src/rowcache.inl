@@ -0,0 +1,192 @@
+// Encoded row cache. Redrawing a row sends the same bytes whenever the row
+// goes from the same content to the same content again, as it does when an
+// application flips between a few screens. The cache keeps those bytes,
+// keyed by both rows, the row index and the output mode, and drops the
+// least recently used entry when it is full.
+//
+// The bytes kept are those which do not depend on the terminal state the
+// row starts from. What does, the attributes and the cursor motion of the
+// first cell sent, is redone from the entry's head fields when it is used.
+
+struct rowcache_entry {
+	uint64_t hash;
+	int y;
+	int mode;
+	int width;
+	// the back row, the front row it replaced and the front row after it
+	// was drawn, 'width' cells each
+	struct tb_cell *cells;
+	struct bytebuffer bytes;
+	// first cell sent and its attributes
+	int head_x;
+	uint16_t head_fg;
+	uint16_t head_bg;
+	// cursor and attributes the row leaves behind
+	int lastx;
+	int lasty;
+	uint16_t lastfg;
+	uint16_t lastbg;
+	// cursor motions and SGR sequences in 'bytes', counted with TB_STATS
+	int moves;
+	int sgrs;
+	// least recently used list, newest first, and hash bucket chain
+	int newer;
+	int older;
+	int next;
+};
+
+struct rowcache {
+	struct rowcache_entry *entries;
+	int cap;
+	int len;
+	int *buckets;
+	int nbuckets;
+	int newest;
+	int oldest;
+	uint64_t hits;
+	uint64_t misses;
+};
+
+static void rowcache_init(struct rowcache *c, int cap)
+{
+	int i;
+	memset(c, 0, sizeof(*c));
+	c->newest = c->oldest = -1;
+	if (cap <= 0)
+		return;
+	c->cap = cap;
+	c->entries = (struct rowcache_entry *)calloc(cap, sizeof(*c->entries));
+	assert(c->entries);
+	for (c->nbuckets = 16; c->nbuckets < cap * 2; c->nbuckets *= 2)
+		;
+	c->buckets = (int *)malloc(sizeof(int) * c->nbuckets);
+	assert(c->buckets);
+	for (i = 0; i < c->nbuckets; i++)
+		c->buckets[i] = -1;
+}
+
+static void rowcache_free(struct rowcache *c)
+{
+	int i;
+	for (i = 0; i < c->len; i++) {
+		free(c->entries[i].cells);
+		bytebuffer_free(&c->entries[i].bytes);
+	}
+	free(c->entries);
+	free(c->buckets);
+	memset(c, 0, sizeof(*c));
+	c->newest = c->oldest = -1;
+}
+
+static inline uint64_t rowcache_hash(const struct tb_cell *back,
+				     const struct tb_cell *front, int n, int y,
+				     int mode)
+{
+	uint64_t h = 0xcbf29ce484222325ull ^ ((uint64_t)y << 32 | (uint32_t)mode);
+	int i;
+	for (i = 0; i < n; i++) {
+		uint64_t b, f;
+		memcpy(&b, back + i, sizeof(b));
+		memcpy(&f, front + i, sizeof(f));
+		h = (h ^ b) * 0x100000001b3ull;
+		h = (h ^ f) * 0x100000001b3ull;
+		h ^= h >> 32;
+	}
+	return h;
+}
+
+static void rowcache_unlink(struct rowcache *c, int i)
+{
+	struct rowcache_entry *e = &c->entries[i];
+	if (e->newer >= 0)
+		c->entries[e->newer].older = e->older;
+	else
+		c->newest = e->older;
+	if (e->older >= 0)
+		c->entries[e->older].newer = e->newer;
+	else
+		c->oldest = e->newer;
+}
+
+static void rowcache_link(struct rowcache *c, int i)
+{
+	struct rowcache_entry *e = &c->entries[i];
+	e->newer = -1;
+	e->older = c->newest;
+	if (c->newest >= 0)
+		c->entries[c->newest].newer = i;
+	else
+		c->oldest = i;
+	c->newest = i;
+}
+
+// returns the entry for drawing 'front' over with 'back', making it the most
+// recently used, or NULL
+static struct rowcache_entry *rowcache_find(struct rowcache *c, uint64_t hash,
+					    const struct tb_cell *back,
+					    const struct tb_cell *front, int n,
+					    int y, int mode)
+{
+	int i;
+	for (i = c->buckets[hash & (c->nbuckets - 1)]; i >= 0;
+	     i = c->entries[i].next) {
+		struct rowcache_entry *e = &c->entries[i];
+		if (e->hash != hash || e->y != y || e->mode != mode ||
+		    e->width != n)
+			continue;
+		if (memcmp(e->cells, back, sizeof(struct tb_cell) * n) ||
+		    memcmp(e->cells + n, front, sizeof(struct tb_cell) * n))
+			continue;
+		rowcache_unlink(c, i);
+		rowcache_link(c, i);
+		c->hits++;
+		return e;
+	}
+	c->misses++;
+	return NULL;
+}
+
+// makes room for a new entry, reusing the least recently used one when the
+// cache is full, and fills in its key. The caller fills in the rest.
+static struct rowcache_entry *rowcache_insert(struct rowcache *c,
+					      uint64_t hash,
+					      const struct tb_cell *back,
+					      const struct tb_cell *front,
+					      int n, int y, int mode)
+{
+	struct rowcache_entry *e;
+	int i, *p;
+
+	if (c->len < c->cap) {
+		i = c->len++;
+		e = &c->entries[i];
+		bytebuffer_init(&e->bytes, 0);
+	} else {
+		i = c->oldest;
+		e = &c->entries[i];
+		rowcache_unlink(c, i);
+		for (p = &c->buckets[e->hash & (c->nbuckets - 1)]; *p != i;
+		     p = &c->entries[*p].next)
+			;
+		*p = e->next;
+	}
+
+	if (e->width != n) {
+		free(e->cells);
+		e->cells = (struct tb_cell *)malloc(sizeof(struct tb_cell) * n * 3);
+		assert(e->cells);
+	}
+	e->hash = hash;
+	e->y = y;
+	e->mode = mode;
+	e->width = n;
+	memcpy(e->cells, back, sizeof(struct tb_cell) * n);
+	memcpy(e->cells + n, front, sizeof(struct tb_cell) * n);
+	bytebuffer_clear(&e->bytes);
+
+	p = &c->buckets[hash & (c->nbuckets - 1)];
+	e->next = *p;
+	*p = i;
+	rowcache_link(c, i);
+	return e;
+}
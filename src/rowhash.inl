@@ -0,0 +1,243 @@
+// Scroll detection. present() hashes the dirty rows of the back buffer and
+// looks for a block of rows which only moved up or down from where the
+// front buffer has them, so that the terminal can shift it in place instead
+// of having all of its cells sent again. Hashes only narrow the search, the
+// block found is compared cell by cell before it is used.
+//
+// The front hashes are kept from one frame to the next: only the rows drawn
+// or scrolled in since are hashed again, and only once they are needed.
+// Rows are compared by a few of their cells first, and frames where no
+// changed row shows what another row did skip the search altogether: no
+// shift could save anything there.
+
+// scrolling the rows [top, bottom] by 'n': content moves up when 'n' is
+// positive and down when it is negative, the |n| rows scrolled in at the
+// opposite edge are blank and have to be redrawn
+struct rowshift {
+	int top;
+	int bottom;
+	int n;
+};
+
+// what of a front row has to be redone once needed, see struct rowhash
+#define ROWHASH_STALE_HASH 1
+#define ROWHASH_STALE_SAMPLE 2
+#define ROWHASH_STALE (ROWHASH_STALE_HASH | ROWHASH_STALE_SAMPLE)
+
+// the hashes of both buffers and what goes with them, for 'h' rows
+struct rowhash {
+	// hash of every front row, its cells which are not blank and its
+	// sample, see rowhash_sample(), with the rows drawn since flagged
+	// stale and 'blank' the blank cell the cells were counted against
+	uint64_t *front;
+	int *front_ink;
+	uint64_t *front_sample;
+	unsigned char *stale;
+	uint64_t blank;
+	// scratch space of one frame: the hashes of the back rows hashed so
+	// far and their cells which are not blank, the running total of their
+	// redraw costs, and an open addressed set of the front samples, each
+	// with the first of the rows having it and 'next' chaining the others
+	uint64_t *back;
+	int *back_ink;
+	unsigned char *hashed;
+	uint64_t *cost;
+	uint64_t *set;
+	int *set_rows;
+	int *next;
+	int nset;
+};
+
+static void rowhash_init(struct rowhash *r, int h)
+{
+	memset(r, 0, sizeof(*r));
+	for (r->nset = 16; r->nset < h * 2; r->nset *= 2)
+		;
+	r->front = (uint64_t *)malloc(sizeof(uint64_t) * (4 * h + 1 + r->nset));
+	assert(r->front);
+	r->front_sample = r->front + h;
+	r->back = r->front_sample + h;
+	r->cost = r->back + h;
+	r->set = r->cost + h + 1;
+	r->front_ink = (int *)malloc(sizeof(int) * (3 * h + r->nset));
+	assert(r->front_ink);
+	r->back_ink = r->front_ink + h;
+	r->next = r->back_ink + h;
+	r->set_rows = r->next + h;
+	r->stale = (unsigned char *)malloc(2 * h + 1);
+	assert(r->stale);
+	r->hashed = r->stale + h;
+	memset(r->stale, ROWHASH_STALE, h);
+}
+
+static void rowhash_free(struct rowhash *r)
+{
+	free(r->front);
+	free(r->front_ink);
+	free(r->stale);
+	memset(r, 0, sizeof(*r));
+}
+
+// hashes a row and counts its cells which differ from 'blank', the cell a
+// cleared screen is filled with
+static inline uint64_t rowhash_row(const struct tb_cell *row, int n,
+				   uint64_t blank, int *ink)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+	int i;
+	*ink = 0;
+	for (i = 0; i < n; i++) {
+		uint64_t c;
+		memcpy(&c, row + i, sizeof(c));
+		h = (h ^ c) * 0x100000001b3ull;
+		h ^= h >> 32;
+		*ink += c != blank;
+	}
+	return h;
+}
+
+// cells of a row hashed before it is hashed in full, equal rows having
+// equal samples
+#define ROWHASH_SAMPLES 16
+
+static inline uint64_t rowhash_sample(const struct tb_cell *row, int n)
+{
+	const int step = n / ROWHASH_SAMPLES;
+	uint64_t h = 0;
+	int i;
+	// a rotation is enough to tell the cells apart, the set only needs
+	// the bits spread once
+	for (i = 0; i < ROWHASH_SAMPLES; i++) {
+		uint64_t c;
+		memcpy(&c, row + i * step, sizeof(c));
+		h = (h << 7 | h >> 57) ^ c;
+	}
+	h *= 0x9e3779b97f4a7c15ull;
+	return h ^ h >> 32;
+}
+
+// the hash of row 'y' of the front buffer 'cells', 'w' cells wide, hashed
+// again if it was drawn since
+static inline uint64_t rowhash_front(struct rowhash *r,
+				     const struct tb_cell *cells, int w, int y)
+{
+	if (r->stale[y] & ROWHASH_STALE_HASH) {
+		r->front[y] = rowhash_row(cells + y * w, w, r->blank,
+					  &r->front_ink[y]);
+		r->stale[y] &= ~ROWHASH_STALE_HASH;
+	}
+	return r->front[y];
+}
+
+// the hash of row 'y' of the back buffer 'cells', hashed once a frame
+static inline uint64_t rowhash_back(struct rowhash *r,
+				    const struct tb_cell *cells, int w, int y)
+{
+	if (!r->hashed[y]) {
+		r->back[y] = rowhash_row(cells + y * w, w, r->blank,
+					 &r->back_ink[y]);
+		r->hashed[y] = 1;
+	}
+	return r->back[y];
+}
+
+// whether a row of 'back' flagged in 'dirty' changed into what another row
+// of 'front' holds. Every shift saving cells moves such a row into place,
+// the rows which kept their content cost nothing, see rowhash_find_shift().
+// Rows are compared by their samples first, only rows with a sample in
+// common are hashed in full. Starts the frame for rowhash_back().
+static int rowhash_any_moved(struct rowhash *r, const struct tb_cell *back,
+			     const struct tb_cell *front,
+			     const unsigned char *dirty, int w, int h)
+{
+	const uint64_t mask = r->nset - 1;
+	uint64_t i, k;
+	int y, o;
+
+	memset(r->hashed, 0, h);
+	// the lowest bit is set in every sample kept so that 0 marks a free
+	// slot
+	memset(r->set, 0, sizeof(uint64_t) * r->nset);
+	for (y = 0; y < h; y++) {
+		if (r->stale[y] & ROWHASH_STALE_SAMPLE) {
+			r->front_sample[y] = rowhash_sample(front + y * w, w);
+			r->stale[y] &= ~ROWHASH_STALE_SAMPLE;
+		}
+		k = r->front_sample[y] | 1;
+		for (i = k & mask; r->set[i] && r->set[i] != k; i = (i + 1) & mask)
+			;
+		r->next[y] = r->set[i] ? r->set_rows[i] : -1;
+		r->set_rows[i] = y;
+		r->set[i] = k;
+	}
+	for (y = 0; y < h; y++) {
+		if (!dirty[y])
+			continue;
+		k = rowhash_sample(back + y * w, w) | 1;
+		for (i = k & mask; r->set[i] && r->set[i] != k; i = (i + 1) & mask)
+			;
+		if (!r->set[i])
+			continue;
+		for (o = r->set_rows[i]; o >= 0; o = r->next[o]) {
+			if (o == y)
+				continue;
+			const uint64_t b = rowhash_back(r, back, w, y);
+			if (b == rowhash_front(r, front, w, o) &&
+			    b != rowhash_front(r, front, w, y))
+				return 1;
+		}
+	}
+	return 0;
+}
+
+// rough price of the escape sequences of a shift, in cells
+#define ROWHASH_SHIFT_COST 16
+
+// sum of the redraw costs of rows [a, b], 'cost' holds their running total
+static inline int rowhash_cost(const uint64_t *cost, int a, int b)
+{
+	return (int)(cost[b + 1] - cost[a]);
+}
+
+// finds the shift which saves redrawing the most cells. 'back' and 'front'
+// hold one hash per row and 'cost' h + 1 running totals of the number of
+// cells every row would have redrawn without a shift, see rowhash_cost().
+// The rows moved into place save their cost, the 'w' cells of every row
+// scrolled in have to be drawn instead. Returns 0 if no shift pays off.
+static int rowhash_find_shift(const uint64_t *back, const uint64_t *front,
+			      const uint64_t *cost, int w, int h,
+			      struct rowshift *out)
+{
+	int n, y, best = 0;
+	for (n = 1 - h; n < h; n++) {
+		if (n == 0)
+			continue;
+		// back row y shows what front row y + n does
+		const int lo = n < 0 ? -n : 0;
+		const int hi = n > 0 ? h - n : h;
+		for (y = lo; y < hi;) {
+			if (back[y] != front[y + n]) {
+				y++;
+				continue;
+			}
+			const int a = y;
+			while (y < hi && back[y] == front[y + n])
+				y++;
+			const int b = y - 1;
+
+			const int m = n > 0 ? n : -n;
+			int gain = rowhash_cost(cost, a, b) - ROWHASH_SHIFT_COST;
+			if (n > 0)
+				gain += rowhash_cost(cost, b + 1, b + n) - w * m;
+			else
+				gain += rowhash_cost(cost, a + n, a - 1) - w * m;
+			if (gain > best) {
+				best = gain;
+				out->top = n > 0 ? a : a + n;
+				out->bottom = n > 0 ? b + n : b;
+				out->n = n;
+			}
+		}
+	}
+	return best > 0;
+}
@@ -11,6 +11,9 @@ enum {
 	T_REVERSE,
 	T_ENTER_KEYPAD,
 	T_EXIT_KEYPAD,
+	T_CLEAR_EOL,
+	T_ERASE_CHARS,
+	T_REPEAT_CHAR,
 	T_ENTER_MOUSE,
 	T_EXIT_MOUSE,
 	T_FUNCS_NUM,
@@ -19,6 +22,10 @@ enum {
 #define ENTER_MOUSE_SEQ "\x1b[?1000h\x1b[?1002h\x1b[?1015h\x1b[?1006h"
 #define EXIT_MOUSE_SEQ "\x1b[?1006l\x1b[?1015l\x1b[?1002l\x1b[?1000l"
 
+// the forms ECH and REP have everywhere, they are the only ones understood
+#define ERASE_CHARS_SEQ "\033[%p1%dX"
+#define REPEAT_CHAR_SEQ "%p1%c\033[%p2%{1}%-%db"
+
 #define EUNSUPPORTED_TERM -1
 
 // rxvt-256color
@@ -26,7 +33,7 @@ static const char *rxvt_256color_keys[] = {
 	"\033[11~","\033[12~","\033[13~","\033[14~","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[7~","\033[8~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *rxvt_256color_funcs[] = {
-	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", "\033[K", ERASE_CHARS_SEQ, "", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
 // Eterm
@@ -34,7 +41,7 @@ static const char *eterm_keys[] = {
 	"\033[11~","\033[12~","\033[13~","\033[14~","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[7~","\033[8~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *eterm_funcs[] = {
-	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "", "",
+	"\0337\033[?47h", "\033[2J\033[?47l\0338", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "\033[K", ERASE_CHARS_SEQ, "", "", "",
 };
 
 // screen
@@ -42,7 +49,7 @@ static const char *screen_keys[] = {
 	"\033OP","\033OQ","\033OR","\033OS","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[1~","\033[4~","\033[5~","\033[6~","\033OA","\033OB","\033OD","\033OC", 0
 };
 static const char *screen_funcs[] = {
-	"\033[?1049h", "\033[?1049l", "\033[34h\033[?25h", "\033[?25l", "\033[H\033[J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\033[?1049h", "\033[?1049l", "\033[34h\033[?25h", "\033[?25l", "\033[H\033[J", "\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", "\033[K", "", "", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
 // rxvt-unicode
@@ -50,7 +57,7 @@ static const char *rxvt_unicode_keys[] = {
 	"\033[11~","\033[12~","\033[13~","\033[14~","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[7~","\033[8~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *rxvt_unicode_funcs[] = {
-	"\033[?1049h", "\033[r\033[?1049l", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m\033(B", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\033[?1049h", "\033[r\033[?1049l", "\033[?25h", "\033[?25l", "\033[H\033[2J", "\033[m\033(B", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033=", "\033>", "\033[K", ERASE_CHARS_SEQ, "", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
 // linux
@@ -58,7 +65,7 @@ static const char *linux_keys[] = {
 	"\033[[A","\033[[B","\033[[C","\033[[D","\033[[E","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033[1~","\033[4~","\033[5~","\033[6~","\033[A","\033[B","\033[D","\033[C", 0
 };
 static const char *linux_funcs[] = {
-	"", "", "\033[?25h\033[?0c", "\033[?25l\033[?1c", "\033[H\033[J", "\033[0;10m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "", "",
+	"", "", "\033[?25h\033[?0c", "\033[?25l\033[?1c", "\033[H\033[J", "\033[0;10m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "", "", "\033[K", ERASE_CHARS_SEQ, "", "", "",
 };
 
 // xterm
@@ -66,68 +73,84 @@ static const char *xterm_keys[] = {
 	"\033OP","\033OQ","\033OR","\033OS","\033[15~","\033[17~","\033[18~","\033[19~","\033[20~","\033[21~","\033[23~","\033[24~","\033[2~","\033[3~","\033OH","\033OF","\033[5~","\033[6~","\033OA","\033OB","\033OD","\033OC", 0
 };
 static const char *xterm_funcs[] = {
-	"\033[?1049h", "\033[?1049l", "\033[?12l\033[?25h", "\033[?25l", "\033[H\033[2J", "\033(B\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
+	"\033[?1049h", "\033[?1049l", "\033[?12l\033[?25h", "\033[?25l", "\033[H\033[2J", "\033(B\033[m", "\033[4m", "\033[1m", "\033[5m", "\033[7m", "\033[?1h\033=", "\033[?1l\033>", "\033[K", ERASE_CHARS_SEQ, REPEAT_CHAR_SEQ, ENTER_MOUSE_SEQ, EXIT_MOUSE_SEQ,
 };
 
+// 'bce' is set for terminals which erase with the current background colour
 static struct term {
 	const char *name;
 	const char **keys;
 	const char **funcs;
+	bool bce;
 } terms[] = {
-	{"rxvt-256color", rxvt_256color_keys, rxvt_256color_funcs},
-	{"Eterm", eterm_keys, eterm_funcs},
-	{"screen", screen_keys, screen_funcs},
-	{"rxvt-unicode", rxvt_unicode_keys, rxvt_unicode_funcs},
-	{"linux", linux_keys, linux_funcs},
-	{"xterm", xterm_keys, xterm_funcs},
-	{0, 0, 0},
+	{"rxvt-256color", rxvt_256color_keys, rxvt_256color_funcs, true},
+	{"Eterm", eterm_keys, eterm_funcs, true},
+	{"screen", screen_keys, screen_funcs, false},
+	{"rxvt-unicode", rxvt_unicode_keys, rxvt_unicode_funcs, true},
+	{"linux", linux_keys, linux_funcs, true},
+	{"xterm", xterm_keys, xterm_funcs, true},
+	{0, 0, 0, false},
 };
 
-static bool init_from_terminfo = false;
-static const char **keys;
-static const char **funcs;
+// what termbox knows of the terminal: the sequences of its keys and of the
+// functions it is sent, and whether erasing takes the current background
+struct termcaps {
+	const char **keys;
+	const char **funcs;
+	bool bce;
+	bool from_terminfo;
+};
 
-static int try_compatible(const char *term, const char *name,
-			  const char **tkeys, const char **tfuncs)
+// the capabilities of $TERM, loaded for the first instance and shared by
+// reference by all of them until the last one is gone
+static struct termcaps shared_caps;
+static int shared_caps_refs;
+static std::mutex shared_caps_lock;
+
+static int try_compatible(struct termcaps *c, const char *term,
+			  const char *name, const char **tkeys,
+			  const char **tfuncs, bool tbce)
 {
 	if (strstr(term, name)) {
-		keys = tkeys;
-		funcs = tfuncs;
+		c->keys = tkeys;
+		c->funcs = tfuncs;
+		c->bce = tbce;
 		return 0;
 	}
 
 	return EUNSUPPORTED_TERM;
 }
 
-static int init_term_builtin(void)
+// the capabilities termbox knows of 'term' without a terminfo database
+static int init_term_builtin(struct termcaps *c, const char *term)
 {
 	int i;
-	const char *term = getenv("TERM");
 
 	if (term) {
 		for (i = 0; terms[i].name; i++) {
 			if (!strcmp(terms[i].name, term)) {
-				keys = terms[i].keys;
-				funcs = terms[i].funcs;
+				c->keys = terms[i].keys;
+				c->funcs = terms[i].funcs;
+				c->bce = terms[i].bce;
 				return 0;
 			}
 		}
 
 		/* let's do some heuristic, maybe it's a compatible terminal */
-		if (try_compatible(term, "xterm", xterm_keys, xterm_funcs) == 0)
+		if (try_compatible(c, term, "xterm", xterm_keys, xterm_funcs, true) == 0)
 			return 0;
-		if (try_compatible(term, "rxvt", rxvt_unicode_keys, rxvt_unicode_funcs) == 0)
+		if (try_compatible(c, term, "rxvt", rxvt_unicode_keys, rxvt_unicode_funcs, true) == 0)
 			return 0;
-		if (try_compatible(term, "linux", linux_keys, linux_funcs) == 0)
+		if (try_compatible(c, term, "linux", linux_keys, linux_funcs, true) == 0)
 			return 0;
-		if (try_compatible(term, "Eterm", eterm_keys, eterm_funcs) == 0)
+		if (try_compatible(c, term, "Eterm", eterm_keys, eterm_funcs, true) == 0)
 			return 0;
-		if (try_compatible(term, "screen", screen_keys, screen_funcs) == 0)
+		if (try_compatible(c, term, "screen", screen_keys, screen_funcs, false) == 0)
 			return 0;
-		if (try_compatible(term, "tmux", screen_keys, screen_funcs) == 0)
+		if (try_compatible(c, term, "tmux", screen_keys, screen_funcs, false) == 0)
 			return 0;
 		/* let's assume that 'cygwin' is xterm compatible */
-		if (try_compatible(term, "cygwin", xterm_keys, xterm_funcs) == 0)
+		if (try_compatible(c, term, "cygwin", xterm_keys, xterm_funcs, false) == 0)
 			return 0;
 	}
 
@@ -232,7 +255,8 @@ static char *load_terminfo(void) {
 
 static const char *terminfo_copy_string(char *data, int str, int table) {
 	const int16_t off = *(int16_t*)(data + str);
-	const char *src = data + table + off;
+	// a negative offset marks a capability the terminal does not have
+	const char *src = off < 0 ? "" : data + table + off;
 	int len = strlen(src);
 	char *dst = (char *)malloc(len+1);
 	strcpy(dst, src);
@@ -240,27 +264,32 @@ static const char *terminfo_copy_string(char *data, int str, int table) {
 }
 
 static const int16_t ti_funcs[] = {
-	28, 40, 16, 13, 5, 39, 36, 27, 26, 34, 89, 88,
+	28, 40, 16, 13, 5, 39, 36, 27, 26, 34, 89, 88, 6, 37, 121,
 };
 
+#define TI_BCE 28
+
 static const int16_t ti_keys[] = {
 	66, 68 /* apparently not a typo; 67 is F10 for whatever reason */, 69,
 	70, 71, 72, 73, 74, 75, 67, 216, 217, 77, 59, 76, 164, 82, 81, 87, 61,
 	79, 83,
 };
 
-static int init_term(void) {
+static int init_term(struct termcaps *c) {
 	int i;
 	char *data = load_terminfo();
 	if (!data) {
-		init_from_terminfo = false;
-		return init_term_builtin();
+		c->from_terminfo = false;
+		return init_term_builtin(c, getenv("TERM"));
 	}
 
 	int16_t *header = (int16_t*)data;
 
 	const int number_sec_len = header[0] == TI_ALT_MAGIC ? 4 : 2;
 
+	c->bce = header[2] > TI_BCE &&
+		data[TI_HEADER_LENGTH + header[1] + TI_BCE] == 1;
+
 	if ((header[1] + header[2]) % 2) {
 		// old quirk to align everything on word boundaries
 		header[2] += 1;
@@ -270,14 +299,16 @@ static int init_term(void) {
 		header[1] + header[2] +	number_sec_len * header[3];
 	const int table_offset = str_offset + 2 * header[4];
 
-	keys = (const char **)malloc(sizeof(const char*) * (TB_KEYS_NUM+1));
+	const char **keys =
+		(const char **)malloc(sizeof(const char*) * (TB_KEYS_NUM+1));
 	for (i = 0; i < TB_KEYS_NUM; i++) {
 		keys[i] = terminfo_copy_string(data,
 			str_offset + 2 * ti_keys[i], table_offset);
 	}
 	keys[TB_KEYS_NUM] = 0;
 
-	funcs = (const char **)malloc(sizeof(const char*) * T_FUNCS_NUM);
+	const char **funcs =
+		(const char **)malloc(sizeof(const char*) * T_FUNCS_NUM);
 	// the last two entries are reserved for mouse. because the table offset is
 	// not there, the two entries have to fill in manually
 	for (i = 0; i < T_FUNCS_NUM-2; i++) {
@@ -288,13 +319,16 @@ static int init_term(void) {
 	funcs[T_FUNCS_NUM-2] = ENTER_MOUSE_SEQ;
 	funcs[T_FUNCS_NUM-1] = EXIT_MOUSE_SEQ;
 
-	init_from_terminfo = true;
+	c->keys = keys;
+	c->funcs = funcs;
+	c->from_terminfo = true;
 	free(data);
 	return 0;
 }
 
-static void shutdown_term(void) {
-	if (init_from_terminfo) {
+static void shutdown_term(struct termcaps *c) {
+	const char **keys = c->keys, **funcs = c->funcs;
+	if (c->from_terminfo) {
 		int i;
 		for (i = 0; i < TB_KEYS_NUM; i++) {
 			free((void*)keys[i]);
@@ -309,3 +343,21 @@ static void shutdown_term(void) {
 		free(funcs);
 	}
 }
+
+// the shared capabilities, loaded if no instance holds them yet, or NULL if
+// the terminal is not supported
+static const struct termcaps *termcaps_acquire(void) {
+	std::lock_guard<std::mutex> lock(shared_caps_lock);
+	if (shared_caps_refs == 0 && init_term(&shared_caps) < 0)
+		return NULL;
+	shared_caps_refs++;
+	return &shared_caps;
+}
+
+static void termcaps_release(void) {
+	std::lock_guard<std::mutex> lock(shared_caps_lock);
+	if (--shared_caps_refs == 0) {
+		shutdown_term(&shared_caps);
+		memset(&shared_caps, 0, sizeof(shared_caps));
+	}
+}
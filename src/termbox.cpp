@@ -10,13 +10,28 @@
 #include <sys/select.h>
 #include <sys/stat.h>
 #include <termios.h>
+#include <time.h>
 #include <unistd.h>
-#include <wchar.h>
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 #include "term.inl"
 
 #include "bytebuffer.inl"
+#include "celldiff.inl"
 #include "input.inl"
+#include "iochain.inl"
+#include "itoa.inl"
+#include "rowcache.inl"
+#include "rowhash.inl"
+#include "uring.inl"
+#include "width.inl"
 
 struct cellbuf {
   int width;
@@ -24,30 +39,52 @@ struct cellbuf {
   struct tb_cell *cells;
 };
 
+/* what present() sends: the cells, the rows which changed since the frame
+ * before, flags being cleared as rows are sent, the cursor and how the cells
+ * are to be sent */
+struct frame {
+  struct cellbuf cells;
+  unsigned char *dirty;
+  int cursor_x;
+  int cursor_y;
+  bool sync;
+  enum output_mode mode;
+};
+
 #define CELL(buf, x, y) (buf)->cells[(y) * (buf)->width + (x)]
 #define IS_CURSOR_HIDDEN(cx, cy) (cx == -1 || cy == -1)
 #define LAST_COORD_INIT -1
 
-static struct termios orig_tios;
-
-static struct cellbuf back_buffer;
-static struct cellbuf front_buffer;
+/* fewer changed rows than that cannot be a scroll worth looking for */
+#define SCROLL_MIN_ROWS 2
 
+/* fewest changed cells worth a band of their own, see draw_frame(). The
+ * tests lower it to have every frame split into bands. */
+#ifndef ENCODE_BAND_MIN_CELLS
+#define ENCODE_BAND_MIN_CELLS 8192
+#endif
 
-static int inout;
-static int winch_fds[2];
-
-static int lastx = LAST_COORD_INIT;
-static int lasty = LAST_COORD_INIT;
-static int cursor_x = -1;
-static int cursor_y = -1;
-
-static uint16_t background = TB_DEFAULT;
-static uint16_t foreground = TB_DEFAULT;
+/* least time between two steps of the bandwidth adaptation, so that a link
+ * falling behind gets to show what one step did before the next, see
+ * termbox_impl::adapt_output() */
+#define ADAPT_STEP_NS 250000000
+/* a write taking longer than that had to wait for the link */
+#define ADAPT_BLOCK_NS 1000000
+
+/* the counters of termbox11::last_frame_stats(), left out unless built with
+ * TB_STATS */
+#ifdef TB_STATS
+#define STATS_ADD(e, field, n) ((e)->stats.field += (n))
+#define STATS_IO (&_stats_io)
+#else
+#define STATS_ADD(e, field, n) ((void)0)
+#define STATS_IO NULL
+#endif
 
 static void cellbuf_init(struct cellbuf *buf, int width, int height);
-static void cellbuf_resize(struct cellbuf *buf, int width, int height);
-static void cellbuf_clear(struct cellbuf *buf);
+static void cellbuf_resize(struct cellbuf *buf, int width, int height,
+                           uint16_t fg, uint16_t bg);
+static void cellbuf_clear(struct cellbuf *buf, uint16_t fg, uint16_t bg);
 static void cellbuf_free(struct cellbuf *buf);
 
 static void sigwinch_handler(int xxx);
@@ -82,81 +119,391 @@ modifiers &operator|=(modifiers &lhs, modifiers rhs) {
 
 /* -------------------------------------------------------- */
 
-void tb_put_cell(int x, int y, const struct tb_cell *cell) {
-  if ((unsigned)x >= (unsigned)back_buffer.width)
-    return;
-  if ((unsigned)y >= (unsigned)back_buffer.height)
-    return;
-  CELL(&back_buffer, x, y) = *cell;
+#define WRITE_LITERAL(X) bytebuffer_append(e->out, (X), sizeof(X) - 1)
+#define WRITE_INT(X)                                                           \
+  do {                                                                         \
+    bytebuffer_reserve(e->out, e->out->len + 10);                              \
+    e->out->len += convertnum((X), e->out->buf + e->out->len);                 \
+  } while (0)
+
+#define LAST_ATTR_INIT 0xFFFF
+
+/* SGR attributes, in the order their codes are emitted */
+#define SGR_BOLD 0x01
+#define SGR_BLINK 0x02
+#define SGR_UNDERLINE 0x04
+#define SGR_REVERSE 0x08
+#define SGR_FLAGS_NUM 4
+
+static const char *const sgr_on_codes[SGR_FLAGS_NUM] = {"1", "5", "4", "7"};
+static const char *const sgr_off_codes[SGR_FLAGS_NUM] = {"22", "25", "24",
+                                                         "27"};
+
+/* one SGR parameter string, like "31" or "38;5;196" */
+struct sgrcode {
+  char str[11];
+  uint8_t len;
+};
+
+/* parameters of every color the terminal can be asked for, indexed by the
+ * palette index termattr holds, 0 being the default color in all modes */
+struct sgrcolors {
+  struct sgrcode normal_fg[16];
+  struct sgrcode normal_bg[16];
+  struct sgrcode palette_fg[256];
+  struct sgrcode palette_bg[256];
+};
+
+static constexpr struct sgrcode sgrcode_make(const char *prefix,
+                                             unsigned num) {
+  struct sgrcode c{};
+  char digits[3] = {};
+  int n = 0;
+  while (*prefix)
+    c.str[c.len++] = *prefix++;
+  do {
+    digits[n++] = '0' + num % 10;
+    num /= 10;
+  } while (num);
+  while (n)
+    c.str[c.len++] = digits[--n];
+  return c;
 }
 
-void tb_change_cell(int x, int y, uint32_t ch, uint16_t fg, uint16_t bg) {
-  struct tb_cell c = {ch, fg, bg};
-  tb_put_cell(x, y, &c);
+static constexpr struct sgrcolors sgrcolors_make(void) {
+  struct sgrcolors t{};
+  unsigned i = 0;
+  t.normal_fg[0] = t.palette_fg[0] = sgrcode_make("", 39);
+  t.normal_bg[0] = t.palette_bg[0] = sgrcode_make("", 49);
+  for (i = 1; i < 16; ++i) {
+    t.normal_fg[i] = sgrcode_make("", 30 + i - 1);
+    t.normal_bg[i] = sgrcode_make("", 40 + i - 1);
+  }
+  for (i = 1; i < 256; ++i) {
+    t.palette_fg[i] = sgrcode_make("38;5;", i);
+    t.palette_bg[i] = sgrcode_make("48;5;", i);
+  }
+  return t;
 }
 
-void tb_blit(int x, int y, int w, int h, const struct tb_cell *cells) {
-  if (x + w < 0 || x >= back_buffer.width)
-    return;
-  if (y + h < 0 || y >= back_buffer.height)
-    return;
-  int xo = 0, yo = 0, ww = w, hh = h;
-  if (x < 0) {
-    xo = -x;
-    ww -= xo;
-    x = 0;
+static constexpr struct sgrcolors sgr_colors = sgrcolors_make();
+
+/* red, green and blue of a palette color as xterm has them */
+struct rgb {
+  int r, g, b;
+};
+
+static constexpr struct rgb palette_rgb(unsigned i) {
+  constexpr struct rgb system[16] = {
+      {0, 0, 0},       {205, 0, 0},     {0, 205, 0},   {205, 205, 0},
+      {0, 0, 238},     {205, 0, 205},   {0, 205, 205}, {229, 229, 229},
+      {127, 127, 127}, {255, 0, 0},     {0, 255, 0},   {255, 255, 0},
+      {92, 92, 255},   {255, 0, 255},   {0, 255, 255}, {255, 255, 255}};
+  if (i < 16)
+    return system[i];
+  if (i >= 232) {
+    const int v = 8 + 10 * (int)(i - 232);
+    return {v, v, v};
   }
-  if (y < 0) {
-    yo = -y;
-    hh -= yo;
-    y = 0;
+  i -= 16;
+  const unsigned l[3] = {i / 36, i / 6 % 6, i % 6};
+  int v[3] = {};
+  for (int k = 0; k < 3; ++k)
+    v[k] = l[k] ? 55 + 40 * (int)l[k] : 0;
+  return {v[0], v[1], v[2]};
+}
+
+/* the normal mode color closest to each palette color, what the bandwidth
+ * adaptation sends for it once it stepped the output down to normal. The
+ * system colors keep their hue, bright or not, 0 stays the default. */
+struct palette_normal {
+  uint8_t color[256];
+};
+
+static constexpr struct palette_normal palette_normal_make(void) {
+  struct palette_normal t{};
+  unsigned i = 0, k = 0;
+  for (i = 1; i < 16; ++i)
+    t.color[i] = 1 + i % 8;
+  for (i = 16; i < 256; ++i) {
+    const struct rgb c = palette_rgb(i);
+    int best = -1;
+    for (k = 0; k < 8; ++k) {
+      const struct rgb n = palette_rgb(k);
+      const int d = (c.r - n.r) * (c.r - n.r) + (c.g - n.g) * (c.g - n.g) +
+                    (c.b - n.b) * (c.b - n.b);
+      if (best < 0 || d < best) {
+        best = d;
+        t.color[i] = 1 + k;
+      }
+    }
   }
-  if (ww > back_buffer.width - x)
-    ww = back_buffer.width - x;
-  if (hh > back_buffer.height - y)
-    hh = back_buffer.height - y;
+  return t;
+}
 
-  int sy;
-  struct tb_cell *dst = &CELL(&back_buffer, x, y);
-  const struct tb_cell *src = cells + yo * w + xo;
-  size_t size = sizeof(struct tb_cell) * ww;
+static constexpr struct palette_normal palette_normal = palette_normal_make();
 
-  for (sy = 0; sy < hh; ++sy) {
-    memcpy(dst, src, size);
-    dst += back_buffer.width;
-    src += w;
+/* attributes as the terminal sees them: the colors are palette indices
+ * already mapped for the output mode, TB_DEFAULT standing for the default */
+struct termattr {
+  uint8_t flags;
+  uint16_t fg;
+  uint16_t bg;
+};
+
+/* one stream of escapes being built and the terminal state it leaves behind:
+ * where the cursor is and which attributes are set, the raw pair they were
+ * made from letting send_attr() skip the common case of consecutive cells
+ * sharing them. present() may build several streams at once, see
+ * termbox11::select_encode_threads(). */
+struct encoder {
+  struct bytebuffer *out;
+  /* scratch space for the spans of one row, see celldiff.inl, and for
+   * encoding a row the row cache misses */
+  struct cellspan *spans;
+  struct bytebuffer rowbuf;
+  struct tb_cell *rowsave;
+  int lastx;
+  int lasty;
+  struct termattr attr;
+  bool attr_valid;
+  uint16_t lastfg;
+  uint16_t lastbg;
+  /* the output mode 'lastfg' and 'lastbg' were mapped in, and the one their
+   * colors are given in, see map_attr() */
+  enum output_mode mode;
+  enum output_mode colors;
+  /* where the bytes which depend on the state the stream started from end,
+   * -1 until a cell was sent: the attributes and the cursor motion of the
+   * first cell, which was sent at 'head_x', 'head_y' in 'head_fg', 'head_bg' */
+  int head;
+  int head_x;
+  int head_y;
+  uint16_t head_fg;
+  uint16_t head_bg;
+#ifdef TB_STATS
+  /* what was found and sent since the counters were last taken, and the
+   * cursor motions and SGR sequences counted when the head was complete */
+  struct frame_stats stats;
+  uint64_t head_moves;
+  uint64_t head_sgrs;
+#endif
+};
+
+/* rows [top, bottom) of a frame, drawn into a stream of their own */
+struct band {
+  struct encoder enc;
+  struct bytebuffer out;
+  int width;
+  int top;
+  int bottom;
+};
+
+/* parameters of one SGR sequence, without the leading CSI and final 'm' */
+struct sgrbuf {
+  char buf[64];
+  int len;
+};
+
+static inline void sgrbuf_code(struct sgrbuf *b, const char *code, int len) {
+  if (b->len)
+    b->buf[b->len++] = ';';
+  memcpy(b->buf + b->len, code, len);
+  b->len += len;
+}
+
+/* the color 'col' of a cell is sent as in the given output mode, a palette
+ * index in all but normal mode */
+template <enum output_mode M>
+static inline uint16_t map_color(uint16_t col, bool fg) {
+  uint16_t c = col & 0xFF;
+  if constexpr (M == output_mode::mode256) {
+    return c;
+  } else if constexpr (M == output_mode::mode216) {
+    if (c > 215)
+      c = fg ? 7 : 0;
+    return c + 0x10;
+  } else if constexpr (M == output_mode::grayscale) {
+    if (c > 23)
+      c = fg ? 23 : 0;
+    return c + 0xe8;
+  } else {
+    return col & 0x0F;
   }
 }
 
-struct tb_cell *tb_cell_buffer(void) {
-  return back_buffer.cells;
+/* the normal mode color closest to 'col' of output mode 'mode' */
+static inline uint16_t map_color_normal(enum output_mode mode, uint16_t col,
+                                        bool fg) {
+  switch (mode) {
+  case output_mode::mode256:
+    return palette_normal.color[map_color<output_mode::mode256>(col, fg)];
+  case output_mode::mode216:
+    return palette_normal.color[map_color<output_mode::mode216>(col, fg)];
+  case output_mode::grayscale:
+    return palette_normal.color[map_color<output_mode::grayscale>(col, fg)];
+  case output_mode::normal:
+  default:
+    return map_color<output_mode::normal>(col, fg);
+  }
 }
 
-void tb_set_clear_attributes(uint16_t fg, uint16_t bg) {
-  foreground = fg;
-  background = bg;
+/* the attributes of a cell in the given output mode, its colors being
+ * given in 'colors': the same mode, or one with more colors the bandwidth
+ * adaptation stepped down to normal */
+template <enum output_mode M>
+static inline struct termattr map_attr(uint16_t fg, uint16_t bg,
+                                       enum output_mode colors) {
+  struct termattr a;
+
+  if (M == output_mode::normal && colors != output_mode::normal) {
+    a.fg = map_color_normal(colors, fg, true);
+    a.bg = map_color_normal(colors, bg, false);
+  } else {
+    a.fg = map_color<M>(fg, true);
+    a.bg = map_color<M>(bg, false);
+  }
+
+  a.flags = 0;
+  if (fg & TB_BOLD)
+    a.flags |= SGR_BOLD;
+  if (bg & TB_BOLD)
+    a.flags |= SGR_BLINK;
+  if (fg & TB_UNDERLINE)
+    a.flags |= SGR_UNDERLINE;
+  if ((fg & TB_REVERSE) || (bg & TB_REVERSE))
+    a.flags |= SGR_REVERSE;
+  return a;
 }
 
-/* -------------------------------------------------------- */
+template <enum output_mode M>
+static inline void sgr_color(struct sgrbuf *b, uint16_t col, bool fg) {
+  const struct sgrcode *c;
+  if constexpr (M == output_mode::normal)
+    c = fg ? &sgr_colors.normal_fg[col] : &sgr_colors.normal_bg[col];
+  else
+    c = fg ? &sgr_colors.palette_fg[col] : &sgr_colors.palette_bg[col];
+  sgrbuf_code(b, c->str, c->len);
+}
 
-static int convertnum(uint32_t num, char *buf) {
-  int i, l = 0;
-  int ch;
-  do {
-    buf[l++] = '0' + (num % 10);
-    num /= 10;
-  } while (num);
-  for (i = 0; i < l / 2; i++) {
-    ch = buf[i];
-    buf[i] = buf[l - 1 - i];
-    buf[l - 1 - i] = ch;
+static inline void sgr_flag(struct sgrbuf *b, const char *code) {
+  sgrbuf_code(b, code, code[1] ? 2 : 1);
+}
+
+/* longest run of unchanged cells the cursor planner considers re-sending
+ * instead of moving over them, any escape sequence is shorter past that */
+#define MAX_RESEND_CELLS 8
+
+/* one candidate cursor motion */
+struct seqbuf {
+  char buf[64];
+  int len;
+};
+
+static void seqbuf_append(struct seqbuf *b, const char *data, int len) {
+  memcpy(b->buf + b->len, data, len);
+  b->len += len;
+}
+
+static void seqbuf_repeat(struct seqbuf *b, char c, int n) {
+  memset(b->buf + b->len, c, n);
+  b->len += n;
+}
+
+/* CSI with a single parameter, left out when it is the default of 1 */
+static void seqbuf_csi(struct seqbuf *b, int n, char final) {
+  seqbuf_append(b, "\033[", 2);
+  if (n != 1)
+    b->len += convertnum(n, b->buf + b->len);
+  b->buf[b->len++] = final;
+}
+
+/* cursor positions of the current size ready to copy: "\033[<y+1>" for
+ * every row and ";<x+1>H" for every column, each padded to 8 bytes so that
+ * it is copied whole */
+#define CUP_EAGER_MAX 1024
+
+struct cupent {
+  char s[7];
+  uint8_t len;
+};
+
+struct cuptab {
+  struct cupent *rows;
+  struct cupent *cols;
+  int width;
+  int height;
+  bool built;
+};
+
+/* sizes the table for 'width' x 'height'. Up to CUP_EAGER_MAX rows and
+ * columns it is filled right away, the entries of a larger one wait for
+ * cuptab_build() from the first frame, see termbox_impl::send_frame(). */
+static void cuptab_resize(struct cuptab *t, int width, int height) {
+  free(t->rows);
+  t->rows = (struct cupent *)malloc(sizeof(struct cupent) *
+                                    (width + height + 1));
+  assert(t->rows);
+  t->cols = t->rows + height;
+  t->width = width;
+  t->height = height;
+  t->built = false;
+}
+
+static void cuptab_build(struct cuptab *t) {
+  int i;
+  if (t->built)
+    return;
+  for (i = 0; i < t->height; ++i) {
+    struct cupent *e = &t->rows[i];
+    memcpy(e->s, "\033[", 2);
+    e->len = 2 + convertnum(i + 1, e->s + 2);
+  }
+  for (i = 0; i < t->width; ++i) {
+    struct cupent *e = &t->cols[i];
+    e->s[0] = ';';
+    e->len = 1 + convertnum(i + 1, e->s + 1);
+    e->s[e->len++] = 'H';
   }
-  return l;
+  t->built = true;
 }
 
-#define WRITE_LITERAL(X) bytebuffer_append(&_output_buffer, (X), sizeof(X) - 1)
-#define WRITE_INT(X)                                                           \
-  bytebuffer_append(&_output_buffer, buf, convertnum((X), buf))
+static void cuptab_free(struct cuptab *t) {
+  free(t->rows);
+  memset(t, 0, sizeof(*t));
+}
+
+/* writes "\033[<y+1>;<x+1>H" to 'dst', which has room for 16 bytes more,
+ * and returns its length */
+static inline int cuptab_write(const struct cuptab *t, char *dst, int x,
+                               int y) {
+  const struct cupent *r = &t->rows[y], *c = &t->cols[x];
+  memcpy(dst, r->s, sizeof(r->s));
+  memcpy(dst + r->len, c->s, sizeof(c->s));
+  return r->len + c->len;
+}
+
+static inline bool cuptab_has(const struct cuptab *t, int x, int y) {
+  return t->built && x < t->width && y < t->height;
+}
+
+static void seqbuf_cup(struct seqbuf *b, const struct cuptab *t, int x,
+                       int y) {
+  /* the home position and the first column leave the defaults out */
+  if (x != 0 && cuptab_has(t, x, y)) {
+    b->len += cuptab_write(t, b->buf + b->len, x, y);
+    return;
+  }
+  seqbuf_append(b, "\033[", 2);
+  if (y != 0 || x != 0) {
+    b->len += convertnum(y + 1, b->buf + b->len);
+    if (x != 0) {
+      b->buf[b->len++] = ';';
+      b->len += convertnum(x + 1, b->buf + b->len);
+    }
+  }
+  b->buf[b->len++] = 'H';
+}
 
 static void cellbuf_init(struct cellbuf *buf, int width, int height) {
   buf->cells =
@@ -166,7 +513,8 @@ static void cellbuf_init(struct cellbuf *buf, int width, int height) {
   buf->height = height;
 }
 
-static void cellbuf_resize(struct cellbuf *buf, int width, int height) {
+static void cellbuf_resize(struct cellbuf *buf, int width, int height,
+                           uint16_t fg, uint16_t bg) {
   if (buf->width == width && buf->height == height)
     return;
 
@@ -175,7 +523,7 @@ static void cellbuf_resize(struct cellbuf *buf, int width, int height) {
   struct tb_cell *oldcells = buf->cells;
 
   cellbuf_init(buf, width, height);
-  cellbuf_clear(buf);
+  cellbuf_clear(buf, fg, bg);
 
   int minw = (width < oldw) ? width : oldw;
   int minh = (height < oldh) ? height : oldh;
@@ -190,24 +538,143 @@ static void cellbuf_resize(struct cellbuf *buf, int width, int height) {
   free(oldcells);
 }
 
-static void cellbuf_clear(struct cellbuf *buf) {
+static void cellbuf_clear(struct cellbuf *buf, uint16_t fg, uint16_t bg) {
   int i;
   int ncells = buf->width * buf->height;
 
   for (i = 0; i < ncells; ++i) {
     buf->cells[i].ch = ' ';
-    buf->cells[i].fg = foreground;
-    buf->cells[i].bg = background;
+    buf->cells[i].fg = fg;
+    buf->cells[i].bg = bg;
   }
 }
 
 static void cellbuf_free(struct cellbuf *buf) { free(buf->cells); }
 
-static void get_term_size(int *w, int *h) {
+/* flags the rows of the unsent frame 'old' in 'f' which replaces it */
+static void frame_merge_dirty(struct frame *f, const struct frame *old) {
+  int y;
+  if (old->cells.height != f->cells.height)
+    return;
+  for (y = 0; y < f->cells.height; ++y)
+    f->dirty[y] |= old->dirty[y];
+}
+
+static void frame_free(struct frame *f) {
+  free(f->cells.cells);
+  free(f->dirty);
+  memset(f, 0, sizeof(*f));
+}
+
+/* forgets the terminal state, the next cell sent starts from scratch */
+static void encoder_reset(struct encoder *e) {
+  e->lastx = LAST_COORD_INIT;
+  e->lasty = LAST_COORD_INIT;
+  e->attr_valid = false;
+  e->lastfg = e->lastbg = LAST_ATTR_INIT;
+  e->head = -1;
+}
+
+/* the same cell attributes map to other colors in another output mode, or
+ * when given in another one */
+static void encoder_select_mode(struct encoder *e, enum output_mode mode,
+                                enum output_mode colors) {
+  if (mode != e->mode || colors != e->colors) {
+    e->lastfg = e->lastbg = LAST_ATTR_INIT;
+    e->mode = mode;
+    e->colors = colors;
+  }
+}
+
+static void encoder_init(struct encoder *e, struct bytebuffer *out,
+                         int width) {
+  e->out = out;
+  e->spans =
+      (struct cellspan *)malloc(sizeof(struct cellspan) * (width / 2 + 1));
+  assert(e->spans);
+  bytebuffer_init(&e->rowbuf, 0);
+  e->rowsave = (struct tb_cell *)malloc(sizeof(struct tb_cell) * (width + 1));
+  assert(e->rowsave);
+  encoder_reset(e);
+}
+
+static void encoder_free(struct encoder *e) {
+  free(e->spans);
+  e->spans = NULL;
+  bytebuffer_free(&e->rowbuf);
+  memset(&e->rowbuf, 0, sizeof(e->rowbuf));
+  free(e->rowsave);
+  e->rowsave = NULL;
+}
+
+static uint64_t monotonic_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#ifdef TB_STATS
+static void frame_stats_add(struct frame_stats *to,
+                            const struct frame_stats *s) {
+  to->frames += s->frames;
+  to->cells_scanned += s->cells_scanned;
+  to->cells_changed += s->cells_changed;
+  to->spans += s->spans;
+  to->cursor_moves += s->cursor_moves;
+  to->sgr_sequences += s->sgr_sequences;
+  to->bytes_written += s->bytes_written;
+  to->writes += s->writes;
+  to->short_writes += s->short_writes;
+  to->diff_ns += s->diff_ns;
+  to->encode_ns += s->encode_ns;
+  to->flush_ns += s->flush_ns;
+}
+
+/* adds what 'e' counted to 's' and starts over. Without 'head' the cursor
+ * motion and the attributes of the first cell are left out, the stream 'e'
+ * is joined to sends them again, see draw_frame(). */
+static void encoder_take_stats(struct encoder *e, struct frame_stats *s,
+                               bool head) {
+  if (!head && e->head >= 0) {
+    e->stats.cursor_moves -= e->head_moves;
+    e->stats.sgr_sequences -= e->head_sgrs;
+  }
+  frame_stats_add(s, &e->stats);
+  e->stats = frame_stats();
+}
+#endif
+
+/* steps of the bandwidth adaptation below 'mode', the last one dropping the
+ * attributes. Any palette mode goes to normal in one step: a palette color
+ * takes as many bytes in mode216 or grayscale as in mode256. */
+static int adapt_levels(enum output_mode mode) {
+  return mode == output_mode::normal ? 1 : 2;
+}
+
+/* the output mode 'mode' is sent in at step 'level' of the bandwidth
+ * adaptation, and whether the attributes are */
+static enum output_mode adapt_mode(enum output_mode mode, int level,
+                                   bool *attrs) {
+  const int levels = adapt_levels(mode);
+  if (level > levels)
+    level = levels;
+  *attrs = level < levels;
+  return level == 0 ? mode : output_mode::normal;
+}
+
+static inline int cell_width(uint32_t ch) {
+  /* nothing below U+1100 is wider than one column */
+  if (ch < 0x1100)
+    return 1;
+  int w = char_width(ch);
+  return w < 1 ? 1 : w;
+}
+
+static void get_term_size(int fd, int *w, int *h) {
   struct winsize sz;
   memset(&sz, 0, sizeof(sz));
 
-  ioctl(inout, TIOCGWINSZ, &sz);
+  ioctl(fd, TIOCGWINSZ, &sz);
 
   if (w)
     *w = sz.ws_col;
@@ -215,107 +682,638 @@ static void get_term_size(int *w, int *h) {
     *h = sz.ws_row;
 }
 
+/* the write ends of the SIGWINCH pipes of all instances, plus one, 0 for
+ * a free slot. The handler wakes them all up without taking the lock:
+ * blocks are only ever added, and it counts itself in 'busy' around each
+ * slot it reads, which winch_unregister() waits on so that a pipe is not
+ * closed while a handler may still write to it. */
+#define WINCH_BLOCK_SLOTS 64
+struct winch_slot {
+  std::atomic<int> fd;
+  std::atomic<int> busy;
+};
+
+struct winch_block {
+  struct winch_slot slots[WINCH_BLOCK_SLOTS];
+  std::atomic<struct winch_block *> next;
+};
+
+static struct winch_block winch_pipes;
+static std::mutex winch_lock;
+static bool winch_installed = false;
+
 static void sigwinch_handler(int xxx) {
   (void)xxx;
+  const int saved = errno;
   const int zzz = 1;
-  write(winch_fds[1], &zzz, sizeof(int));
+  for (struct winch_block *b = &winch_pipes; b; b = b->next.load()) {
+    for (int i = 0; i < WINCH_BLOCK_SLOTS; ++i) {
+      struct winch_slot *s = &b->slots[i];
+      s->busy.fetch_add(1);
+      const int fd = s->fd.load();
+      if (fd)
+        write(fd - 1, &zzz, sizeof(int));
+      s->busy.fetch_sub(1);
+    }
+  }
+  errno = saved;
+}
+
+/* has SIGWINCH wake up 'fd', the handler being installed for the first */
+static struct winch_slot *winch_register(int fd) {
+  std::lock_guard<std::mutex> lock(winch_lock);
+  struct winch_block *b = &winch_pipes;
+  for (;;) {
+    for (int i = 0; i < WINCH_BLOCK_SLOTS; ++i) {
+      if (!b->slots[i].fd.load()) {
+        b->slots[i].fd.store(fd + 1);
+        if (!winch_installed) {
+          struct sigaction sa;
+          memset(&sa, 0, sizeof(sa));
+          sa.sa_handler = sigwinch_handler;
+          sa.sa_flags = 0;
+          sigaction(SIGWINCH, &sa, 0);
+          winch_installed = true;
+        }
+        return &b->slots[i];
+      }
+    }
+    if (!b->next.load())
+      b->next.store(new winch_block{});
+    b = b->next.load();
+  }
+}
+
+/* stops SIGWINCH from waking up the pipe of 'slot', which may be closed
+ * once this returns: a handler which read the slot before it was cleared
+ * is done with it by then */
+static void winch_unregister(struct winch_slot *slot) {
+  std::lock_guard<std::mutex> lock(winch_lock);
+  slot->fd.store(0);
+  while (slot->busy.load())
+    std::this_thread::yield();
+}
+
+/* the instances alive, the last created last, and the one of them the tb_*
+ * functions draw into */
+static std::mutex instances_lock;
+static std::vector<termbox11 *> instances;
+static std::atomic<termbox11 *> default_instance{nullptr};
+
+static void instance_register(termbox11 *tb) {
+  std::lock_guard<std::mutex> lock(instances_lock);
+  instances.push_back(tb);
+  default_instance.store(tb, std::memory_order_release);
+}
+
+static void instance_unregister(termbox11 *tb) {
+  std::lock_guard<std::mutex> lock(instances_lock);
+  instances.erase(std::find(instances.begin(), instances.end(), tb));
+  default_instance.store(instances.empty() ? nullptr : instances.back(),
+                         std::memory_order_release);
 }
 
 struct termbox_impl {
 public:
+  void dirty_rows_init(int height);
+  void dirty_rows_mark(int y, int h);
+  void dirty_rows_free(void);
+  void frame_capture(struct frame *f, bool merge, bool dirty_only);
   void update_term_size();
   void update_size();
   event_type wait_fill_event(struct tb_event *event, struct timeval *timeout);
-  void write_cursor(int x, int y);
-  void write_sgr(uint16_t fg, uint16_t bg);
-  void send_attr(uint16_t fg, uint16_t bg);
-  void send_char(int x, int y, uint32_t c);
+  void write_cursor(struct encoder *e, int x, int y);
+  void move_rows(struct seqbuf *b, int from, int to);
+  void move_columns(struct encoder *e, struct seqbuf *b, int from, int to,
+                    int y);
+  void move_cursor(struct encoder *e, int x, int y);
+  template <enum output_mode M>
+  void send_attr(struct encoder *e, uint16_t fg, uint16_t bg);
+  void send_attr(struct encoder *e, enum output_mode mode,
+                 enum output_mode colors, uint16_t fg, uint16_t bg);
+  template <enum output_mode M>
+  void draw_row(struct encoder *e, const struct tb_cell *backrow,
+                struct tb_cell *frontrow, int y, int nspans);
+  template <enum output_mode M>
+  void draw_row_cached(struct encoder *e, const struct tb_cell *backrow,
+                       struct tb_cell *frontrow, int y, int nspans);
+  template <enum output_mode M>
+  void draw_rows(struct encoder *e, const struct cellbuf *back,
+                 unsigned char *dirty, int top, int bottom);
+  void draw_rows(struct encoder *e, enum output_mode mode,
+                 enum output_mode colors, const struct cellbuf *back,
+                 unsigned char *dirty, int top, int bottom);
+  void draw_frame(const struct cellbuf *back, unsigned char *dirty,
+                  enum output_mode mode, enum output_mode colors);
+  void encode_loop(int band, unsigned round);
+  void send_char(struct encoder *e, int x, int y, uint32_t c);
+  int send_erase(struct encoder *e, const struct tb_cell *row, int x, int y);
+  int send_repeat(struct encoder *e, const struct tb_cell *row, int x);
   void send_clear(void);
+  void send_scroll(const struct cellbuf *back, unsigned char *dirty);
+  void send_frame(struct frame *f);
+  void adapt_output(enum output_mode mode);
+  void report_adaptation(void);
+  bool submit_frame(struct frame *f);
+  void pace_frames(void);
+  void init_output(void);
+  void send_ref(const char *data, int len);
+  void flush_output(void);
+  void write_chain(void);
+  void write_output(void);
+  void write_some(void);
+  void drain_output(void);
+  void render_loop(void);
   int read_up_to(int n);
+#ifdef TB_STATS
+  void stats_take_io(void);
+#endif
 
 private:
+  /* the terminal, its capabilities shared with the other instances, the
+   * settings to restore and the pipe the SIGWINCH handler wakes us up
+   * through */
+  int _inout{-1};
+  const struct termcaps *_caps{nullptr};
+  struct termios _orig_tios;
+  int _winch_fds[2]{-1, -1};
+  struct winch_slot *_winch_slot{nullptr};
+  /* what the input parser learnt about the terminal */
+  struct input_state _input{};
+  /* headless instances have no terminal but what '_headless_io' connects
+   * them to and capabilities of their own, see
+   * termbox11(const headless_io &) */
+  bool _headless{false};
+  headless_io _headless_io{};
+  struct termcaps _headless_caps{};
+  bool _headless_resized{false};
+
   size_t _w;
   size_t _h;
+  struct cellbuf _back_buffer{};
+  struct cellbuf _front_buffer{};
+  /* one flag per back buffer row, raised by every write path and consumed
+   * by present(), so that the diff only visits rows which may have
+   * changed */
+  unsigned char *_dirty_rows{nullptr};
+  /* scroll detection, see rowhash.inl. The encoders flag the rows they
+   * draw stale in it. */
+  struct rowhash _scroll{};
+  int _cursor_x{-1};
+  int _cursor_y{-1};
+  uint16_t _background{TB_DEFAULT};
+  uint16_t _foreground{TB_DEFAULT};
+
   bool _buffer_size_change_request;
   struct bytebuffer _output_buffer;
+  /* what the output buffer references in place, see send_ref() */
+  struct iochain _output_chain{};
   struct bytebuffer _input_buffer;
+  /* io_uring backend, see termbox11(int, io_backend). Only the thread
+   * calling poll_event() and present() uses it, the render thread writes on
+   * its own. */
+  struct uring _ring;
   input_mode _inputmode{true, false, false};
   output_mode _outputmode{output_mode::normal};
+  bool _sync_output{false};
+  bool _sync_queried{false};
+  bool _async_output{false};
+  /* in asynchronous output mode, the latest frame presented while the one
+   * before was still being written, see termbox11::select_async_output() */
+  struct frame _pending{};
+  bool _frame_pending{false};
+  /* frame pacing, see termbox11::select_frame_rate(): the frames presented
+   * since the last one sent, merged, and when the next may go out */
+  uint64_t _frame_interval{0};
+  uint64_t _next_frame{0};
+  struct frame _paced{};
+  bool _paced_pending{false};
+  /* whether '_paced' holds the back buffer but for the rows flagged dirty,
+   * so that the next capture copies those only */
+  bool _paced_cells{false};
+  bool _cursor_hidden{true};
+
+  /* render thread, see termbox11::select_render_thread(). The worker owns
+   * the output state (front buffer, output buffer, terminal attributes and
+   * cursor) while it sends a frame, other threads take '_output_lock' to
+   * touch it. Frames go round three slots: the one present() fills, the
+   * one ready to be sent and the one being sent, moved under '_frame_lock'
+   * only. */
+  std::thread _render_thread;
+  bool _render_running{false};
+  std::mutex _output_lock;
+  std::mutex _frame_lock;
+  std::condition_variable _frame_cond;
+  struct frame _frames[3]{};
+  int _fill{0};
+  int _ready{1};
+  int _rendering{2};
+  bool _frame_ready{false};
+  bool _render_busy{false};
+  bool _render_stop{false};
+
+  /* the stream going to the terminal */
+  struct encoder _enc{};
+  /* cursor positions of the current size, see cuptab_resize() */
+  struct cuptab _cup{};
+
+  /* encoder threads, see termbox11::select_encode_threads(). Thread i - 1
+   * draws band i of a frame, the thread presenting it draws band 0 into
+   * '_enc' meanwhile. A round starts when '_band_round' moves on. */
+  std::vector<std::thread> _encode_threads;
+  std::vector<struct band> _bands;
+  std::mutex _band_lock;
+  std::condition_variable _band_start;
+  std::condition_variable _band_done;
+  unsigned _band_round{0};
+  int _band_count{0};
+  int _bands_left{0};
+  bool _band_stop{false};
+  const struct cellbuf *_band_back{nullptr};
+  unsigned char *_band_dirty{nullptr};
+  enum output_mode _band_mode{output_mode::normal};
+  enum output_mode _band_colors{output_mode::normal};
+
+  /* encoded row cache, see termbox11::select_row_cache(). The lock keeps
+   * the encoder threads from stepping on each other in it. */
+  struct rowcache _row_cache{};
+  std::mutex _cache_lock;
+  /* whether the terminal's reset is a bare SGR, then it can be merged with
+   * the attributes following it */
+  bool _plain_sgr0{false};
+  int _sgr0_len{0};
+
+  /* bandwidth adaptation, see termbox11::select_adaptive_output(). The
+   * thread sending frames samples the link and steps the output down or up,
+   * '_drop_attrs' being fixed for a frame like its output mode. The step
+   * taken last waits under '_adapt_lock' for the caller to report it. */
+  bool _adapt{false};
+  output_adaptation _adaptation{};
+  int _adapt_level{0};
+  bool _adapt_repaint{false};
+  bool _drop_attrs{false};
+  uint64_t _adapt_last{0};
+  uint64_t _adapt_changed_at{0};
+  uint64_t _adapt_clear_since{0};
+  int _adapt_backoff{1};
+  bool _adapt_stepped_up{false};
+  int _adapt_queued{0};
+  uint64_t _adapt_sent{0};
+  uint64_t _adapt_written{0};
+  uint64_t _adapt_write_ns{0};
+  std::mutex _adapt_lock;
+  bool _adapt_report{false};
+  output_mode _adapt_report_mode{output_mode::normal};
+  bool _adapt_report_attrs{true};
+
+#ifdef TB_STATS
+  /* the counters of the last frame sent and the totals of those before it,
+   * see termbox11::last_frame_stats(), and the writes not added to them
+   * yet. They belong to whoever holds the output. */
+  struct frame_stats _stats_last{};
+  struct frame_stats _stats_total{};
+  struct iostats _stats_io{};
+#endif
 
   friend termbox11;
 };
 
+/* -------------------------------------------------------- */
+
+void termbox11::put_cell(int x, int y, const struct tb_cell *cell) {
+  struct cellbuf *back = &_impl->_back_buffer;
+  if ((unsigned)x >= (unsigned)back->width)
+    return;
+  if ((unsigned)y >= (unsigned)back->height)
+    return;
+  CELL(back, x, y) = *cell;
+  _impl->_dirty_rows[y] = 1;
+}
+
+void termbox11::change_cell(int x, int y, uint32_t ch, uint16_t fg,
+                            uint16_t bg) {
+  struct tb_cell c = {ch, fg, bg};
+  put_cell(x, y, &c);
+}
+
+void termbox11::blit(int x, int y, int w, int h,
+                     const struct tb_cell *cells) {
+  struct cellbuf *back = &_impl->_back_buffer;
+  if (x + w < 0 || x >= back->width)
+    return;
+  if (y + h < 0 || y >= back->height)
+    return;
+  int xo = 0, yo = 0, ww = w, hh = h;
+  if (x < 0) {
+    xo = -x;
+    ww -= xo;
+    x = 0;
+  }
+  if (y < 0) {
+    yo = -y;
+    hh -= yo;
+    y = 0;
+  }
+  if (ww > back->width - x)
+    ww = back->width - x;
+  if (hh > back->height - y)
+    hh = back->height - y;
+
+  int sy;
+  struct tb_cell *dst = &CELL(back, x, y);
+  const struct tb_cell *src = cells + yo * w + xo;
+  size_t size = sizeof(struct tb_cell) * ww;
+
+  for (sy = 0; sy < hh; ++sy) {
+    memcpy(dst, src, size);
+    dst += back->width;
+    src += w;
+  }
+  _impl->dirty_rows_mark(y, hh);
+}
+
+struct tb_cell *termbox11::cell_buffer() {
+  return _impl->_back_buffer.cells;
+}
+
+void termbox11::mark_dirty(int y, int h) { _impl->dirty_rows_mark(y, h); }
+
+void termbox11::set_clear_attributes(uint16_t fg, uint16_t bg) {
+  _impl->_foreground = fg;
+  _impl->_background = bg;
+}
+
+/* the tb_* functions draw into the most recently created instance alive */
+
+void tb_put_cell(int x, int y, const struct tb_cell *cell) {
+  if (termbox11 *tb = default_instance.load(std::memory_order_acquire))
+    tb->put_cell(x, y, cell);
+}
+
+void tb_change_cell(int x, int y, uint32_t ch, uint16_t fg, uint16_t bg) {
+  if (termbox11 *tb = default_instance.load(std::memory_order_acquire))
+    tb->change_cell(x, y, ch, fg, bg);
+}
+
+void tb_blit(int x, int y, int w, int h, const struct tb_cell *cells) {
+  if (termbox11 *tb = default_instance.load(std::memory_order_acquire))
+    tb->blit(x, y, w, h, cells);
+}
+
+struct tb_cell *tb_cell_buffer(void) {
+  termbox11 *tb = default_instance.load(std::memory_order_acquire);
+  return tb ? tb->cell_buffer() : NULL;
+}
+
+void tb_mark_dirty(int y, int h) {
+  if (termbox11 *tb = default_instance.load(std::memory_order_acquire))
+    tb->mark_dirty(y, h);
+}
+
+int tb_char_width(uint32_t ch) { return char_width(ch); }
+
+void tb_set_clear_attributes(uint16_t fg, uint16_t bg) {
+  if (termbox11 *tb = default_instance.load(std::memory_order_acquire))
+    tb->set_clear_attributes(fg, bg);
+}
+
+
+
+void termbox_impl::dirty_rows_init(int height) {
+  _dirty_rows = (unsigned char *)calloc(height ? height : 1, 1);
+  assert(_dirty_rows);
+  rowhash_init(&_scroll, height);
+}
+
+void termbox_impl::dirty_rows_mark(int y, int h) {
+  if (y < 0) {
+    h += y;
+    y = 0;
+  }
+  if (h > _back_buffer.height - y)
+    h = _back_buffer.height - y;
+  if (h > 0)
+    memset(_dirty_rows + y, 1, h);
+}
+
+void termbox_impl::dirty_rows_free(void) {
+  free(_dirty_rows);
+  rowhash_free(&_scroll);
+}
+
+/* copies the back buffer, its dirty rows and the cursor into 'f' and starts
+ * the next frame with no dirty rows. With 'merge' the rows flagged in 'f'
+ * stay flagged, 'f' being a frame which is dropped unsent. With
+ * 'dirty_only' 'f' holds the back buffer already except for the rows
+ * flagged dirty, only those are copied. */
+void termbox_impl::frame_capture(struct frame *f, bool merge,
+                                 bool dirty_only) {
+  const int w = _back_buffer.width, h = _back_buffer.height;
+  int y;
+
+  if (f->cells.width != w || f->cells.height != h) {
+    free(f->cells.cells);
+    cellbuf_init(&f->cells, w, h);
+    free(f->dirty);
+    f->dirty = (unsigned char *)calloc(h ? h : 1, 1);
+    assert(f->dirty);
+    dirty_only = false;
+  }
+  if (dirty_only) {
+    for (y = 0; y < h; ++y)
+      if (_dirty_rows[y])
+        memcpy(&CELL(&f->cells, 0, y), &CELL(&_back_buffer, 0, y),
+               sizeof(struct tb_cell) * w);
+  } else {
+    memcpy(f->cells.cells, _back_buffer.cells,
+           sizeof(struct tb_cell) * w * h);
+  }
+  for (y = 0; y < h; ++y)
+    f->dirty[y] = (merge && f->dirty[y]) || _dirty_rows[y];
+  memset(_dirty_rows, 0, h);
+  f->cursor_x = _cursor_x;
+  f->cursor_y = _cursor_y;
+}
+
 void termbox_impl::update_term_size() {
-  struct winsize sz;
-  memset(&sz, 0, sizeof(sz));
+  if (_headless) {
+    _w = _headless_io.width;
+    _h = _headless_io.height;
+  } else {
+    struct winsize sz;
+    memset(&sz, 0, sizeof(sz));
 
-  ioctl(inout, TIOCGWINSZ, &sz);
+    ioctl(_inout, TIOCGWINSZ, &sz);
 
-  _w = sz.ws_col;
-  _h = sz.ws_row;
+    _w = sz.ws_col;
+    _h = sz.ws_row;
+  }
+  cuptab_resize(&_cup, _w, _h);
+  if (_w + _h <= CUP_EAGER_MAX)
+    cuptab_build(&_cup);
 }
 
 void termbox_impl::update_size() {
+    std::lock_guard<std::mutex> lock(_output_lock);
     update_term_size();
-    cellbuf_resize(&back_buffer, _w, _h);
-    cellbuf_resize(&front_buffer, _w, _h);
-    cellbuf_clear(&front_buffer);
+    cellbuf_resize(&_back_buffer, _w, _h, _foreground, _background);
+    cellbuf_resize(&_front_buffer, _w, _h, _foreground, _background);
+    cellbuf_clear(&_front_buffer, _foreground, _background);
+    dirty_rows_free();
+    dirty_rows_init(_h);
+    dirty_rows_mark(0, _h);
+    encoder_free(&_enc);
+    encoder_init(&_enc, &_output_buffer, _w);
+    /* a frame waiting to be sent has the old size, every row is redrawn
+     * with the next one anyway */
+    _frame_pending = false;
+    _paced_pending = false;
     send_clear();
 }
 event_type termbox_impl::wait_fill_event(struct tb_event *event,
                                          struct timeval *timeout) {
 #define ENOUGH_DATA_FOR_PARSING 64
-  fd_set events;
+  fd_set events, writes;
   memset(event, 0, sizeof(struct tb_event));
 
+  if (_async_output)
+    drain_output();
+  if (_paced_pending)
+    pace_frames();
+  if (_adapt)
+    report_adaptation();
+
   // try to extract event from input buffer, return on success
   event->type = event_type::key;
-  if (extract_event(event, &_input_buffer, _inputmode))
+  if (extract_event(&_input, event, &_input_buffer, _inputmode))
     return event->type;
 
   // it looks like input buffer is incomplete, let's try the short path,
-  // but first make sure there is enough space
-  int n = read_up_to(ENOUGH_DATA_FOR_PARSING);
+  // but first make sure there is enough space. The ring has the input
+  // already, if any came.
+  int n;
+  if (_ring.fd >= 0) {
+    uring_reap(&_ring);
+    n = _ring.input;
+    _ring.input = 0;
+    if (_ring.error)
+      return event_type::error;
+  } else {
+    n = read_up_to(ENOUGH_DATA_FOR_PARSING);
+  }
   if (n < 0)
     return event_type::error;
-  if (n > 0 && extract_event(event, &_input_buffer, _inputmode))
+  if (n > 0 && extract_event(&_input, event, &_input_buffer, _inputmode))
     return event->type;
 
-  // n == 0, or not enough data, let's go to select
-  while (1) {
-    FD_ZERO(&events);
-    FD_SET(inout, &events);
-    FD_SET(winch_fds[0], &events);
-    int maxfd = (winch_fds[0] > inout) ? winch_fds[0] : inout;
-    int result = select(maxfd + 1, &events, 0, 0, timeout);
-    if (!result)
+  /* nothing to wait on without a terminal */
+  if (_headless) {
+    if (!_headless_resized)
       return event_type::none;
+    _headless_resized = false;
+    _buffer_size_change_request = true;
+    event->type = event_type::resize;
+    event->w = _headless_io.width;
+    event->h = _headless_io.height;
+    return event_type::resize;
+  }
 
-    if (FD_ISSET(inout, &events)) {
-      event->type = event_type::key;
-      n = read_up_to(ENOUGH_DATA_FOR_PARSING);
-      if (n < 0)
-        return event_type::error;
+  // n == 0, or not enough data, let's go to select
+  while (1) {
+    /* queued output goes out whenever the terminal takes more of it */
+    const bool out = _async_output && _output_buffer.len > 0;
+    /* wake up for a paced frame if it is due before the caller's timeout,
+     * times in microseconds, rounded up so as not to wake up early */
+    struct timeval tv, *wait = timeout;
+    uint64_t left = 0;
+    if (_paced_pending) {
+      const uint64_t now = monotonic_ns();
+      left = _next_frame > now ? (_next_frame - now + 999) / 1000 : 0;
+      if (!timeout ||
+          left < (uint64_t)timeout->tv_sec * 1000000 + timeout->tv_usec) {
+        tv.tv_sec = left / 1000000;
+        tv.tv_usec = left % 1000000;
+        wait = &tv;
+      }
+    }
+    bool readable, writable, winch;
+    int result;
+    if (_ring.fd >= 0) {
+      uring_arm(&_ring, _inout, _winch_fds[0], out);
+      result = uring_wait(&_ring, wait);
+      readable = _ring.input || _ring.error;
+      writable = _ring.writable;
+      winch = _ring.winch;
+      _ring.writable = _ring.winch = false;
+    } else {
+      int maxfd = (_winch_fds[0] > _inout) ? _winch_fds[0] : _inout;
+      FD_ZERO(&events);
+      FD_SET(_inout, &events);
+      FD_SET(_winch_fds[0], &events);
+      FD_ZERO(&writes);
+      if (out)
+        FD_SET(_inout, &writes);
+      result = select(maxfd + 1, &events, &writes, 0, wait);
+      readable = result > 0 && FD_ISSET(_inout, &events);
+      writable = result > 0 && FD_ISSET(_inout, &writes);
+      winch = result > 0 && FD_ISSET(_winch_fds[0], &events);
+    }
+    if (wait == &tv && timeout) {
+      /* take the time waited off the caller's timeout */
+      const uint64_t waited = left - ((uint64_t)tv.tv_sec * 1000000 + tv.tv_usec);
+      uint64_t rest = (uint64_t)timeout->tv_sec * 1000000 + timeout->tv_usec;
+      rest = rest > waited ? rest - waited : 0;
+      timeout->tv_sec = rest / 1000000;
+      timeout->tv_usec = rest % 1000000;
+    }
+    if (result < 0 && errno == EINTR)
+      continue;
+    if (!result) {
+      if (wait == &tv) {
+        pace_frames();
+        continue;
+      }
+      return event_type::none;
+    }
+
+    if (writable)
+      drain_output();
+
+    if (readable) {
+      event->type = event_type::key;
+      if (_ring.fd >= 0) {
+        n = _ring.error ? -1 : _ring.input;
+        _ring.input = 0;
+      } else {
+        n = read_up_to(ENOUGH_DATA_FOR_PARSING);
+      }
+      if (n < 0)
+        return event_type::error;
 
       if (n == 0)
         continue;
 
-      if (extract_event(event, &_input_buffer, _inputmode))
+      if (extract_event(&_input, event, &_input_buffer, _inputmode))
         return event->type;
     }
-    if (FD_ISSET(winch_fds[0], &events)) {
+    if (winch) {
       event->type = event_type::resize;
       int zzz = 0;
-      read(winch_fds[0], &zzz, sizeof(int));
+      read(_winch_fds[0], &zzz, sizeof(int));
       _buffer_size_change_request = true;
-      get_term_size(&event->w, &event->h);
+      get_term_size(_inout, &event->w, &event->h);
       return event_type::resize;
     }
   }
 }
 
-void termbox_impl::write_cursor(int x, int y) {
-  char buf[32];
+void termbox_impl::write_cursor(struct encoder *e, int x, int y) {
+  STATS_ADD(e, cursor_moves, 1);
+  if (cuptab_has(&_cup, x, y)) {
+    bytebuffer_reserve(e->out, e->out->len + 16);
+    e->out->len += cuptab_write(&_cup, e->out->buf + e->out->len, x, y);
+    return;
+  }
   WRITE_LITERAL("\033[");
   WRITE_INT(y + 1);
   WRITE_LITERAL(";");
@@ -323,133 +1321,364 @@ void termbox_impl::write_cursor(int x, int y) {
   WRITE_LITERAL("H");
 }
 
-void termbox_impl::write_sgr(uint16_t fg, uint16_t bg) {
-  char buf[32];
-
-  if (fg == TB_DEFAULT && bg == TB_DEFAULT)
+template <enum output_mode M>
+void termbox_impl::send_attr(struct encoder *e, uint16_t fg, uint16_t bg) {
+  if (fg == e->lastfg && bg == e->lastbg)
     return;
 
-  switch (_outputmode) {
+  struct termattr want = map_attr<M>(fg, bg, e->colors);
+  struct sgrbuf set, delta;
+  int i;
+
+  /* what has to follow a full reset */
+  set.len = 0;
+  for (i = 0; i < SGR_FLAGS_NUM; ++i)
+    if (want.flags & (1 << i))
+      sgr_flag(&set, sgr_on_codes[i]);
+  if (want.fg != TB_DEFAULT)
+    sgr_color<M>(&set, want.fg, true);
+  if (want.bg != TB_DEFAULT)
+    sgr_color<M>(&set, want.bg, false);
+
+  /* the reset can be folded into the same sequence when the terminal's own
+   * one is a bare SGR, otherwise it is sent as is and followed by the rest */
+  int reset_len;
+  if (_plain_sgr0)
+    reset_len = set.len ? set.len + 5 : 3;
+  else
+    reset_len = _sgr0_len + (set.len ? set.len + 3 : 0);
+
+  /* what changes from the attributes the terminal already has */
+  delta.len = 0;
+  if (e->attr_valid) {
+    const uint8_t off = e->attr.flags & ~want.flags;
+    const uint8_t on = want.flags & ~e->attr.flags;
+    for (i = 0; i < SGR_FLAGS_NUM; ++i) {
+      if (off & (1 << i))
+        sgr_flag(&delta, sgr_off_codes[i]);
+      if (on & (1 << i))
+        sgr_flag(&delta, sgr_on_codes[i]);
+    }
+    if (want.fg != e->attr.fg)
+      sgr_color<M>(&delta, want.fg, true);
+    if (want.bg != e->attr.bg)
+      sgr_color<M>(&delta, want.bg, false);
+  }
+
+  if (e->attr_valid && (delta.len ? delta.len + 3 : 0) <= reset_len) {
+    if (delta.len) {
+      WRITE_LITERAL("\033[");
+      bytebuffer_append(e->out, delta.buf, delta.len);
+      WRITE_LITERAL("m");
+      STATS_ADD(e, sgr_sequences, 1);
+    }
+  } else if (_plain_sgr0) {
+    STATS_ADD(e, sgr_sequences, 1);
+    if (set.len) {
+      WRITE_LITERAL("\033[0;");
+      bytebuffer_append(e->out, set.buf, set.len);
+      WRITE_LITERAL("m");
+    } else {
+      WRITE_LITERAL("\033[m");
+    }
+  } else {
+    bytebuffer_append(e->out, _caps->funcs[T_SGR0], _sgr0_len);
+    STATS_ADD(e, sgr_sequences, 1);
+    if (set.len) {
+      WRITE_LITERAL("\033[");
+      bytebuffer_append(e->out, set.buf, set.len);
+      WRITE_LITERAL("m");
+      STATS_ADD(e, sgr_sequences, 1);
+    }
+  }
+
+  e->attr = want;
+  e->attr_valid = true;
+  e->lastfg = fg;
+  e->lastbg = bg;
+}
+
+/* for the few attribute changes outside of the emitters of present() */
+void termbox_impl::send_attr(struct encoder *e, enum output_mode mode,
+                             enum output_mode colors, uint16_t fg,
+                             uint16_t bg) {
+  encoder_select_mode(e, mode, colors);
+  switch (mode) {
   case output_mode::mode256:
+    send_attr<output_mode::mode256>(e, fg, bg);
+    break;
   case output_mode::mode216:
+    send_attr<output_mode::mode216>(e, fg, bg);
+    break;
   case output_mode::grayscale:
-    WRITE_LITERAL("\033[");
-    if (fg != TB_DEFAULT) {
-      WRITE_LITERAL("38;5;");
-      WRITE_INT(fg);
-      if (bg != TB_DEFAULT) {
-        WRITE_LITERAL(";");
-      }
-    }
-    if (bg != TB_DEFAULT) {
-      WRITE_LITERAL("48;5;");
-      WRITE_INT(bg);
-    }
-    WRITE_LITERAL("m");
+    send_attr<output_mode::grayscale>(e, fg, bg);
     break;
   case output_mode::normal:
   default:
-    WRITE_LITERAL("\033[");
-    if (fg != TB_DEFAULT) {
-      WRITE_LITERAL("3");
-      WRITE_INT(fg - 1);
-      if (bg != TB_DEFAULT) {
-        WRITE_LITERAL(";");
-      }
-    }
-    if (bg != TB_DEFAULT) {
-      WRITE_LITERAL("4");
-      WRITE_INT(bg - 1);
-    }
-    WRITE_LITERAL("m");
+    send_attr<output_mode::normal>(e, fg, bg);
     break;
   }
 }
-void termbox_impl::send_attr(uint16_t fg, uint16_t bg) {
-#define LAST_ATTR_INIT 0xFFFF
-  static uint16_t lastfg = LAST_ATTR_INIT, lastbg = LAST_ATTR_INIT;
-  if (fg != lastfg || bg != lastbg) {
-    bytebuffer_puts(&_output_buffer, funcs[T_SGR0]);
-
-    uint16_t fgcol;
-    uint16_t bgcol;
 
-    switch (_outputmode) {
-    case output_mode::mode256:
-      fgcol = fg & 0xFF;
-      bgcol = bg & 0xFF;
-      break;
+/* cheapest way to go from row 'from' to row 'to' keeping the column */
+void termbox_impl::move_rows(struct seqbuf *b, int from, int to) {
+  struct seqbuf vpa;
+  vpa.len = 0;
+  seqbuf_csi(&vpa, to + 1, 'd');
+
+  const int start = b->len;
+  if (to > from) {
+    /* with OPOST off a line feed only moves down, and it cannot scroll
+     * since the target row is on the screen */
+    if (to - from <= 4)
+      seqbuf_repeat(b, '\n', to - from);
+    else
+      seqbuf_csi(b, to - from, 'B');
+  } else if (to < from) {
+    seqbuf_csi(b, from - to, 'A');
+  }
+  if (b->len - start > vpa.len) {
+    b->len = start;
+    seqbuf_append(b, vpa.buf, vpa.len);
+  }
+}
 
-    case output_mode::mode216:
-      fgcol = fg & 0xFF;
-      if (fgcol > 215)
-        fgcol = 7;
-      bgcol = bg & 0xFF;
-      if (bgcol > 215)
-        bgcol = 0;
-      fgcol += 0x10;
-      bgcol += 0x10;
-      break;
+/* cheapest way to go from column 'from' to column 'to' on row 'y' */
+void termbox_impl::move_columns(struct encoder *e, struct seqbuf *b, int from,
+                                int to, int y) {
+  struct seqbuf cand;
+  int i;
 
-    case output_mode::grayscale:
-      fgcol = fg & 0xFF;
-      if (fgcol > 23)
-        fgcol = 23;
-      bgcol = bg & 0xFF;
-      if (bgcol > 23)
-        bgcol = 0;
-      fgcol += 0xe8;
-      bgcol += 0xe8;
-      break;
+  if (from == to)
+    return;
 
-    case output_mode::normal:
-    default:
-      fgcol = fg & 0x0F;
-      bgcol = bg & 0x0F;
+  cand.len = 0;
+  seqbuf_csi(&cand, to + 1, 'G');
+
+  if (to < from) {
+    struct seqbuf rel;
+    rel.len = 0;
+    if (from - to <= 4)
+      seqbuf_repeat(&rel, '\b', from - to);
+    else
+      seqbuf_csi(&rel, from - to, 'D');
+    if (rel.len < cand.len)
+      cand = rel;
+  } else {
+    struct seqbuf rel;
+    rel.len = 0;
+    seqbuf_csi(&rel, to - from, 'C');
+    if (rel.len < cand.len)
+      cand = rel;
+
+    /* writing the cells in between again moves the cursor too, as long as
+     * they are plain single column characters in the current attributes;
+     * the front buffer holds what the terminal shows for all of them */
+    if (to - from <= MAX_RESEND_CELLS && e->attr_valid) {
+      rel.len = 0;
+      for (i = from; i < to; ++i) {
+        const struct tb_cell *c = &CELL(&_front_buffer, i, y);
+        if (c->ch == 0 || char_width(c->ch) != 1 || c->fg != e->lastfg ||
+            c->bg != e->lastbg)
+          break;
+        rel.len += tb_utf8_unicode_to_char(rel.buf + rel.len, c->ch);
+      }
+      if (i == to && rel.len < cand.len)
+        cand = rel;
     }
+  }
+  seqbuf_append(b, cand.buf, cand.len);
+}
 
-    if (fg & TB_BOLD)
-      bytebuffer_puts(&_output_buffer, funcs[T_BOLD]);
-    if (bg & TB_BOLD)
-      bytebuffer_puts(&_output_buffer, funcs[T_BLINK]);
-    if (fg & TB_UNDERLINE)
-      bytebuffer_puts(&_output_buffer, funcs[T_UNDERLINE]);
-    if ((fg & TB_REVERSE) || (bg & TB_REVERSE))
-      bytebuffer_puts(&_output_buffer, funcs[T_REVERSE]);
+void termbox_impl::move_cursor(struct encoder *e, int x, int y) {
+  struct seqbuf best, cand;
+
+  best.len = 0;
+  seqbuf_cup(&best, &_cup, x, y);
+
+  /* relative motions need a known cursor which is not parked in the last
+   * column, where terminals differ on what the next motion does, and a
+   * target on the screen (the visible cursor may lag behind a resize) */
+  if (e->lasty != LAST_COORD_INIT && e->lastx + 1 < (int)_w && x < (int)_w &&
+      y < (int)_h) {
+    const int cx = e->lastx + 1;
+
+    cand.len = 0;
+    move_rows(&cand, e->lasty, y);
+    move_columns(e, &cand, cx, x, y);
+    if (cand.len < best.len)
+      best = cand;
+
+    if (x < cx) {
+      cand.len = 0;
+      cand.buf[cand.len++] = '\r';
+      move_rows(&cand, e->lasty, y);
+      move_columns(e, &cand, 0, x, y);
+      if (cand.len < best.len)
+        best = cand;
+    }
+  }
 
-    write_sgr(fgcol, bgcol);
+  bytebuffer_append(e->out, best.buf, best.len);
+  STATS_ADD(e, cursor_moves, 1);
+}
 
-    lastfg = fg;
-    lastbg = bg;
+/* everything sent after the attributes and the cursor motion of the first
+ * cell is the same whatever the stream started from, see draw_frame() */
+static inline void encoder_mark_head(struct encoder *e, int x, int y) {
+  if (e->head < 0) {
+    e->head = e->out->len;
+    e->head_x = x;
+    e->head_y = y;
+    e->head_fg = e->lastfg;
+    e->head_bg = e->lastbg;
+#ifdef TB_STATS
+    e->head_moves = e->stats.cursor_moves;
+    e->head_sgrs = e->stats.sgr_sequences;
+#endif
   }
 }
 
-void termbox_impl::send_char(int x, int y, uint32_t c) {
+void termbox_impl::send_char(struct encoder *e, int x, int y, uint32_t c) {
   char buf[7];
   int bw = tb_utf8_unicode_to_char(buf, c);
-  if (x - 1 != lastx || y != lasty)
-    write_cursor(x, y);
-  lastx = x;
-  lasty = y;
+  if (x - 1 != e->lastx || y != e->lasty)
+    move_cursor(e, x, y);
+  encoder_mark_head(e, x, y);
+  /* remember the last column taken, the cursor sits right after it; it is
+   * unknown after a character the terminal may not advance over */
+  if (c && char_width(c) < 1) {
+    e->lastx = LAST_COORD_INIT;
+    e->lasty = LAST_COORD_INIT;
+  } else {
+    e->lastx = x + cell_width(c) - 1;
+    e->lasty = y;
+  }
   if (!c)
     buf[0] = ' '; // replace 0 with whitespace
-  bytebuffer_append(&_output_buffer, buf, bw);
+  bytebuffer_append(e->out, buf, bw);
+}
+
+/* erases the run of blank cells starting at column 'x' of 'row' with EL or
+ * ECH if that is shorter than sending the spaces, and returns how many cells
+ * were erased, or 0. The attributes of the run must have been sent already. */
+int termbox_impl::send_erase(struct encoder *e, const struct tb_cell *row,
+                             int x, int y) {
+  const int w = _front_buffer.width;
+  int n, cost;
+
+  /* erased cells take the current background on terminals with bce and the
+   * default one elsewhere, but never underline or reverse video */
+  if (!e->attr_valid || (e->attr.flags & (SGR_UNDERLINE | SGR_REVERSE)))
+    return 0;
+  if (e->attr.bg != TB_DEFAULT && !_caps->bce)
+    return 0;
+
+  for (n = 1; x + n < w; ++n) {
+    if (memcmp(&row[x + n], &row[x], sizeof(struct tb_cell)))
+      break;
+  }
+
+  const bool eol = x + n == w && *_caps->funcs[T_CLEAR_EOL];
+  const bool ech = !strcmp(_caps->funcs[T_ERASE_CHARS], ERASE_CHARS_SEQ);
+  if (eol) {
+    cost = strlen(_caps->funcs[T_CLEAR_EOL]);
+  } else if (ech) {
+    /* ECH leaves the cursor alone, whatever follows has to move past the
+     * run, see move_cursor() */
+    cost = 3 + numlen(n);
+    if (x + n < w)
+      cost += 3 + numlen(n);
+  } else {
+    return 0;
+  }
+  if (n <= cost)
+    return 0;
+
+  if (x - 1 != e->lastx || y != e->lasty)
+    move_cursor(e, x, y);
+  encoder_mark_head(e, x, y);
+  if (eol) {
+    bytebuffer_puts(e->out, _caps->funcs[T_CLEAR_EOL]);
+  } else {
+    WRITE_LITERAL("\033[");
+    WRITE_INT(n);
+    WRITE_LITERAL("X");
+  }
+  e->lastx = x - 1;
+  e->lasty = y;
+  return n;
+}
+
+/* repeats the character just sent at column 'x' of 'row' over the run of
+ * identical cells following it with REP, if that is shorter than sending
+ * them, and returns the number of cells repeated, or 0 */
+int termbox_impl::send_repeat(struct encoder *e, const struct tb_cell *row,
+                              int x) {
+  char buf[32];
+  const int w = _front_buffer.width;
+  int n;
+
+  if (strcmp(_caps->funcs[T_REPEAT_CHAR], REPEAT_CHAR_SEQ))
+    return 0;
+  /* only characters which advance the cursor by exactly one column repeat
+   * the same way everywhere */
+  if (row[x].ch != 0 && char_width(row[x].ch) != 1)
+    return 0;
+
+  for (n = 0; x + 1 + n < w; ++n) {
+    if (memcmp(&row[x + 1 + n], &row[x], sizeof(struct tb_cell)))
+      break;
+  }
+  if (n * tb_utf8_unicode_to_char(buf, row[x].ch) <= 3 + numlen(n))
+    return 0;
+
+  WRITE_LITERAL("\033[");
+  WRITE_INT(n);
+  WRITE_LITERAL("b");
+  e->lastx = x + n;
+  return n;
 }
 
 void termbox_impl::send_clear(void) {
-  send_attr(foreground, background);
-  bytebuffer_puts(&_output_buffer, funcs[T_CLEAR_SCREEN]);
-  if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
-    write_cursor(cursor_x, cursor_y);
-  bytebuffer_flush(&_output_buffer, inout);
+  /* start over from a reset rather than trusting the tracked state */
+  encoder_reset(&_enc);
+  send_attr(&_enc, _outputmode, _outputmode, _foreground, _background);
+  bytebuffer_puts(&_output_buffer, _caps->funcs[T_CLEAR_SCREEN]);
+  if (!IS_CURSOR_HIDDEN(_cursor_x, _cursor_y))
+    write_cursor(&_enc, _cursor_x, _cursor_y);
+  flush_output();
 
   /* we need to invalidate cursor position too and these two vars are
    * used only for simple cursor positioning optimization, cursor
    * actually may be in the correct place, but we simply discard
    * optimization once and it gives us simple solution for the case when
    * cursor moved */
-  lastx = LAST_COORD_INIT;
-  lasty = LAST_COORD_INIT;
+  _enc.lastx = LAST_COORD_INIT;
+  _enc.lasty = LAST_COORD_INIT;
+}
+
+/* sets up the output state of the current size and switches the terminal to
+ * a cleared alternate screen */
+void termbox_impl::init_output(void) {
+  const char **funcs = _caps->funcs;
+  const char *sgr0 = funcs[T_SGR0];
+  _plain_sgr0 = !strcmp(sgr0, "\033[m") || !strcmp(sgr0, "\033[0m");
+  _sgr0_len = strlen(sgr0);
+
+  update_term_size();
+  encoder_init(&_enc, &_output_buffer, _w);
+
+  bytebuffer_puts(&_output_buffer, funcs[T_ENTER_CA]);
+  bytebuffer_puts(&_output_buffer, funcs[T_ENTER_KEYPAD]);
+  bytebuffer_puts(&_output_buffer, funcs[T_HIDE_CURSOR]);
+  send_clear();
+
+  cellbuf_init(&_back_buffer, _w, _h);
+  cellbuf_init(&_front_buffer, _w, _h);
+  cellbuf_clear(&_back_buffer, _foreground, _background);
+  cellbuf_clear(&_front_buffer, _foreground, _background);
+  dirty_rows_init(_h);
 }
 
 int termbox_impl::read_up_to(int n) {
@@ -460,8 +1689,15 @@ int termbox_impl::read_up_to(int n) {
   int read_n = 0;
   while (read_n <= n) {
     ssize_t r = 0;
-    if (read_n < n) {
-      r = read(inout, _input_buffer.buf + prevlen + read_n, n - read_n);
+    if (read_n < n && _headless) {
+      char *buf = _input_buffer.buf + prevlen + read_n;
+      r = _headless_io.input ? _headless_io.input(buf, n - read_n) : 0;
+      if (r < 0) {
+        bytebuffer_resize(&_input_buffer, prevlen + read_n);
+        return -1;
+      }
+    } else if (read_n < n) {
+      r = read(_inout, _input_buffer.buf + prevlen + read_n, n - read_n);
     }
 #ifdef __CYGWIN__
     // While linux man for tty says when VMIN == 0 && VTIME == 0, read
@@ -471,9 +1707,10 @@ int termbox_impl::read_up_to(int n) {
     if (r < 0)
       r = 0;
 #endif
+    // the tty is non-blocking in asynchronous output mode
+    if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+      r = 0;
     if (r < 0) {
-      // EAGAIN / EWOULDBLOCK shouldn't occur here
-      assert(errno != EAGAIN && errno != EWOULDBLOCK);
       return -1;
     } else if (r > 0) {
       read_n += r;
@@ -491,32 +1728,36 @@ termbox11::termbox11() : termbox11("/dev/tty") {}
 termbox11::termbox11(std::string name)
     : termbox11(open(name.c_str(), O_RDWR)) {}
 
-termbox11::termbox11(int fd) : _impl(std::make_unique<termbox_impl>()) {
-  inout = fd;
+termbox11::termbox11(int fd) : termbox11(fd, io_backend::standard) {}
+
+termbox11::termbox11(int fd, ::io_backend backend)
+    : _impl(std::make_unique<termbox_impl>()) {
+  const int inout = _impl->_inout = fd;
   if (inout == -1) {
     throw std::runtime_error("failed to open tty");
   }
 
-  if (init_term() < 0) {
+  _impl->_caps = termcaps_acquire();
+  if (!_impl->_caps) {
     close(inout);
     throw std::runtime_error("unsupported terminal");
   }
+  _impl->_input.keys = _impl->_caps->keys;
 
-  if (pipe(winch_fds) < 0) {
+  if (pipe(_impl->_winch_fds) < 0) {
+    termcaps_release();
     close(inout);
     throw std::runtime_error("epipe trap");
   }
+  /* signals coming faster than they are read must not block the handler */
+  fcntl(_impl->_winch_fds[1], F_SETFL,
+        fcntl(_impl->_winch_fds[1], F_GETFL) | O_NONBLOCK);
+  _impl->_winch_slot = winch_register(_impl->_winch_fds[1]);
 
-  struct sigaction sa;
-  memset(&sa, 0, sizeof(sa));
-  sa.sa_handler = sigwinch_handler;
-  sa.sa_flags = 0;
-  sigaction(SIGWINCH, &sa, 0);
-
-  tcgetattr(inout, &orig_tios);
+  tcgetattr(inout, &_impl->_orig_tios);
 
   struct termios tios;
-  memcpy(&tios, &orig_tios, sizeof(tios));
+  memcpy(&tios, &_impl->_orig_tios, sizeof(tios));
 
   tios.c_iflag &=
       ~(IGNBRK | BRKINT | PARMRK | ISTRIP | INLCR | IGNCR | ICRNL | IXON);
@@ -531,86 +1772,228 @@ termbox11::termbox11(int fd) : _impl(std::make_unique<termbox_impl>()) {
   bytebuffer_init(&_impl->_input_buffer, 128);
   bytebuffer_init(&_impl->_output_buffer, 32 * 1024);
 
-  bytebuffer_puts(&_impl->_output_buffer, funcs[T_ENTER_CA]);
-  bytebuffer_puts(&_impl->_output_buffer, funcs[T_ENTER_KEYPAD]);
-  bytebuffer_puts(&_impl->_output_buffer, funcs[T_HIDE_CURSOR]);
-  _impl->send_clear();
+  /* io_uring may be missing or disabled, the standard backend does then */
+  if (backend == io_backend::io_uring)
+    uring_init(&_impl->_ring, &_impl->_input_buffer);
 
-  _impl->update_term_size();
-  cellbuf_init(&back_buffer, _impl->_w, _impl->_h);
-  cellbuf_init(&front_buffer, _impl->_w, _impl->_h);
-  cellbuf_clear(&back_buffer);
-  cellbuf_clear(&front_buffer);
+  _impl->init_output();
+  instance_register(this);
+}
+
+termbox11::termbox11(const ::headless_io &io)
+    : _impl(std::make_unique<termbox_impl>()) {
+  _impl->_headless = true;
+  _impl->_headless_io = io;
+  if (init_term_builtin(&_impl->_headless_caps, io.term.c_str()) < 0)
+    throw std::runtime_error("unsupported terminal");
+  _impl->_caps = &_impl->_headless_caps;
+  _impl->_input.keys = _impl->_caps->keys;
+
+  bytebuffer_init(&_impl->_input_buffer, 128);
+  bytebuffer_init(&_impl->_output_buffer, 32 * 1024);
+  _impl->init_output();
+  instance_register(this);
 }
 
 termbox11::~termbox11() {
+  instance_unregister(this);
+
+  /* whatever is still queued goes out ahead of the shutdown sequences */
+  select_frame_rate(0);
+  select_render_thread(false);
+  select_async_output(false);
+  select_encode_threads(1);
+  select_row_cache(0);
+  const char **funcs = _impl->_caps->funcs;
   bytebuffer_puts(&_impl->_output_buffer, funcs[T_SHOW_CURSOR]);
   bytebuffer_puts(&_impl->_output_buffer, funcs[T_SGR0]);
   bytebuffer_puts(&_impl->_output_buffer, funcs[T_CLEAR_SCREEN]);
   bytebuffer_puts(&_impl->_output_buffer, funcs[T_EXIT_CA]);
   bytebuffer_puts(&_impl->_output_buffer, funcs[T_EXIT_KEYPAD]);
   bytebuffer_puts(&_impl->_output_buffer, funcs[T_EXIT_MOUSE]);
-  bytebuffer_flush(&_impl->_output_buffer, inout);
-  tcsetattr(inout, TCSAFLUSH, &orig_tios);
-
-  shutdown_term();
-  close(inout);
-  close(winch_fds[0]);
-  close(winch_fds[1]);
+  _impl->write_chain();
+  if (!_impl->_headless) {
+    uring_free(&_impl->_ring);
+    tcsetattr(_impl->_inout, TCSAFLUSH, &_impl->_orig_tios);
+
+    termcaps_release();
+    close(_impl->_inout);
+    winch_unregister(_impl->_winch_slot);
+    close(_impl->_winch_fds[0]);
+    close(_impl->_winch_fds[1]);
+  }
 
-  cellbuf_free(&back_buffer);
-  cellbuf_free(&front_buffer);
+  cellbuf_free(&_impl->_back_buffer);
+  cellbuf_free(&_impl->_front_buffer);
+  frame_free(&_impl->_pending);
+  frame_free(&_impl->_paced);
+  for (int i = 0; i < 3; ++i)
+    frame_free(&_impl->_frames[i]);
+  _impl->dirty_rows_free();
+  encoder_free(&_impl->_enc);
+  cuptab_free(&_impl->_cup);
+  iochain_free(&_impl->_output_chain);
   bytebuffer_free(&_impl->_output_buffer);
   bytebuffer_free(&_impl->_input_buffer);
   _impl->_w = _impl->_h = SIZE_MAX;
 }
 
+::io_backend termbox11::io_backend() {
+  return _impl->_ring.fd >= 0 ? io_backend::io_uring : io_backend::standard;
+}
+
 size_t termbox11::width() const { return _impl->_w; }
 size_t termbox11::height() const { return _impl->_h; }
 
-void termbox11::clear() {
-  if (_impl->_buffer_size_change_request) {
-    _impl->update_size();
-    _impl->_buffer_size_change_request = 0;
-  }
-  cellbuf_clear(&back_buffer);
+void termbox11::resize(int width, int height) {
+  if (!_impl->_headless)
+    return;
+  _impl->_headless_io.width = width;
+  _impl->_headless_io.height = height;
+  _impl->_headless_resized = true;
 }
 
-void termbox11::present() {
-  int x, y, w, i;
-  struct tb_cell *back, *front;
+/* shifts rows which only moved up or down since the last present() on the
+ * terminal, leaving just the rows scrolled in to be redrawn */
+void termbox_impl::send_scroll(const struct cellbuf *back_buf,
+                               unsigned char *dirty) {
+  struct encoder *e = &_enc;
+  struct rowhash *r = &_scroll;
+  const int w = _front_buffer.width, h = _front_buffer.height;
+  const struct tb_cell blankcell = {' ', _foreground, _background};
+  struct rowshift shift;
+  uint64_t blank;
+  int y, ndirty = 0;
+
+  for (y = 0; y < h; ++y)
+    ndirty += dirty[y];
+  if (ndirty < SCROLL_MIN_ROWS)
+    return;
 
-  /* invalidate cursor position */
-  lastx = LAST_COORD_INIT;
-  lasty = LAST_COORD_INIT;
+  /* the front rows counted their cells against another blank cell */
+  memcpy(&blank, &blankcell, sizeof(blank));
+  if (blank != r->blank) {
+    for (y = 0; y < h; ++y)
+      r->stale[y] |= ROWHASH_STALE_HASH;
+    r->blank = blank;
+  }
+  if (!rowhash_any_moved(r, back_buf->cells, _front_buffer.cells, dirty, w,
+                         h))
+    return;
 
-  if (_impl->_buffer_size_change_request) {
-    _impl->update_size();
-    _impl->_buffer_size_change_request = false;
+  /* the front rows drawn since they were last hashed and the back rows
+   * which may differ */
+  for (y = 0; y < h; ++y) {
+    rowhash_front(r, _front_buffer.cells, w, y);
+    if (dirty[y])
+      rowhash_back(r, back_buf->cells, w, y);
+    else
+      r->back[y] = r->front[y];
+  }
+
+  /* a row which changed costs about as many cells as it or the row it
+   * replaces has which are not blank */
+  r->cost[0] = 0;
+  for (y = 0; y < h; ++y) {
+    r->cost[y + 1] = r->cost[y];
+    if (r->back[y] != r->front[y])
+      r->cost[y + 1] += r->back_ink[y] > r->front_ink[y] ? r->back_ink[y]
+                                                          : r->front_ink[y];
+  }
+  if (!rowhash_find_shift(r->back, r->front, r->cost, w, h, &shift))
+    return;
+
+  const int n = shift.n > 0 ? shift.n : -shift.n;
+  const int first = shift.n > 0 ? shift.top : shift.top + n;
+  const int last = shift.n > 0 ? shift.bottom - n : shift.bottom;
+  for (y = first; y <= last; ++y) {
+    if (memcmp(&CELL(back_buf, 0, y), &CELL(&_front_buffer, 0, y + shift.n),
+               sizeof(struct tb_cell) * w))
+      return;
+  }
+
+  /* a region reaching the bottom is the default one, deleting or inserting
+   * lines at its top is enough then */
+  if (shift.bottom != h - 1) {
+    WRITE_LITERAL("\033[");
+    WRITE_INT(shift.top + 1);
+    WRITE_LITERAL(";");
+    WRITE_INT(shift.bottom + 1);
+    WRITE_LITERAL("r");
   }
+  write_cursor(e, 0, shift.top);
+  WRITE_LITERAL("\033[");
+  if (n != 1)
+    WRITE_INT(n);
+  if (shift.n > 0)
+    WRITE_LITERAL("M");
+  else
+    WRITE_LITERAL("L");
+  if (shift.bottom != h - 1)
+    WRITE_LITERAL("\033[r");
+  e->lastx = LAST_COORD_INIT;
+  e->lasty = LAST_COORD_INIT;
+
+  /* mirror the shift in the front buffer, the rows scrolled in get cells no
+   * back buffer holds so that all of them are redrawn */
+  memmove(&CELL(&_front_buffer, 0, first),
+          &CELL(&_front_buffer, 0, first + shift.n),
+          sizeof(struct tb_cell) * w * (last - first + 1));
+  memmove(r->front + first, r->front + first + shift.n,
+          sizeof(uint64_t) * (last - first + 1));
+  memmove(r->front_ink + first, r->front_ink + first + shift.n,
+          sizeof(int) * (last - first + 1));
+  memmove(r->front_sample + first, r->front_sample + first + shift.n,
+          sizeof(uint64_t) * (last - first + 1));
+  const int exposed = shift.n > 0 ? last + 1 : shift.top;
+  memset(&CELL(&_front_buffer, 0, exposed), 0xFF,
+         sizeof(struct tb_cell) * w * n);
+  memset(dirty + exposed, 1, n);
+  memset(r->stale + exposed, ROWHASH_STALE, n);
+}
 
-  for (y = 0; y < front_buffer.height; ++y) {
-    for (x = 0; x < front_buffer.width;) {
-      back = &CELL(&back_buffer, x, y);
-      front = &CELL(&front_buffer, x, y);
-      w = wcwidth(back->ch);
-      if (w < 1)
-        w = 1;
-      if (memcmp(back, front, sizeof(struct tb_cell)) == 0) {
-        x += w;
+/* sends the 'nspans' spans of 'backrow' found to differ from 'frontrow' */
+template <enum output_mode M>
+void termbox_impl::draw_row(struct encoder *e, const struct tb_cell *backrow,
+                            struct tb_cell *frontrow, int y, int nspans) {
+  int x, w, i, n, s;
+  const struct tb_cell *back;
+  struct tb_cell *front;
+  const struct cellspan *spans = e->spans;
+
+  x = 0;
+  for (s = 0; s < nspans; ++s) {
+    /* walk up to the span like a full scan would, so that a span starting
+     * on the second half of a wide character is skipped the same way */
+    while (x < spans[s].begin)
+      x += cell_width(backrow[x].ch);
+    while (x < spans[s].end) {
+      back = &backrow[x];
+      front = &frontrow[x];
+      w = cell_width(back->ch);
+      memcpy(front, back, sizeof(struct tb_cell));
+      if (_drop_attrs)
+        send_attr<M>(e, TB_DEFAULT, TB_DEFAULT);
+      else
+        send_attr<M>(e, back->fg, back->bg);
+      if (back->ch == ' ' && (n = send_erase(e, backrow, x, y)) > 0) {
+        memcpy(front, back, sizeof(struct tb_cell) * n);
+        x += n;
         continue;
       }
-      memcpy(front, back, sizeof(struct tb_cell));
-      _impl->send_attr(back->fg, back->bg);
-      if (w > 1 && x >= front_buffer.width - (w - 1)) {
+      if (w > 1 && x >= _front_buffer.width - (w - 1)) {
         // Not enough room for wide ch, so send spaces
-        for (i = x; i < front_buffer.width; ++i) {
-          _impl->send_char(i, y, ' ');
+        for (i = x; i < _front_buffer.width; ++i) {
+          send_char(e, i, y, ' ');
         }
       } else {
-        _impl->send_char(x, y, back->ch);
+        send_char(e, x, y, back->ch);
+        if (w == 1 && (n = send_repeat(e, backrow, x)) > 0) {
+          memcpy(front + 1, back + 1, sizeof(struct tb_cell) * n);
+          x += n;
+        }
         for (i = 1; i < w; ++i) {
-          front = &CELL(&front_buffer, x + i, y);
+          front = &frontrow[x + i];
           front->ch = 0;
           front->fg = back->fg;
           front->bg = back->bg;
@@ -619,10 +2002,658 @@ void termbox11::present() {
       x += w;
     }
   }
-  if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
-    _impl->write_cursor(cursor_x, cursor_y);
-  bytebuffer_flush(&_impl->_output_buffer, inout);
 }
+
+/* draw_row() through the row cache. A row drawn from a blank state sends the
+ * same bytes as from any other once its first cell is placed, see
+ * draw_frame(), so an entry holds those and the head is redone for 'e'. */
+template <enum output_mode M>
+void termbox_impl::draw_row_cached(struct encoder *e,
+                                   const struct tb_cell *backrow,
+                                   struct tb_cell *frontrow, int y,
+                                   int nspans) {
+  const int w = _front_buffer.width;
+  /* rows sent without attributes or stepped down from another mode are told
+   * apart by the mode */
+  const int mode =
+      (int)M | (int)e->colors << 4 | (_drop_attrs ? 0x100 : 0);
+  const uint64_t hash = rowcache_hash(backrow, frontrow, w, y, mode);
+  const struct rowcache_entry *c;
+  int lastx, lasty;
+  uint16_t fg, bg;
+
+  std::unique_lock<std::mutex> lock(_cache_lock);
+  c = rowcache_find(&_row_cache, hash, backrow, frontrow, w, y, mode);
+  if (c) {
+    send_attr<M>(e, c->head_fg, c->head_bg);
+    if (c->head_x - 1 != e->lastx || y != e->lasty)
+      move_cursor(e, c->head_x, y);
+    encoder_mark_head(e, c->head_x, y);
+    /* copied rather than referenced: a miss later in the same frame may
+     * evict the entry and reuse its bytes before the output is written */
+    bytebuffer_append(e->out, c->bytes.buf, c->bytes.len);
+    STATS_ADD(e, cursor_moves, c->moves);
+    STATS_ADD(e, sgr_sequences, c->sgrs);
+    memcpy(frontrow, c->cells + 2 * w, sizeof(struct tb_cell) * w);
+    lastx = c->lastx;
+    lasty = c->lasty;
+    fg = c->lastfg;
+    bg = c->lastbg;
+  } else {
+    lock.unlock();
+
+    struct encoder r = *e;
+    r.out = &e->rowbuf;
+    bytebuffer_clear(r.out);
+    encoder_reset(&r);
+    memcpy(e->rowsave, frontrow, sizeof(struct tb_cell) * w);
+    draw_row<M>(&r, backrow, frontrow, y, nspans);
+    /* the spans may all have fallen on the second half of wide characters */
+    if (r.head < 0)
+      return;
+
+    send_attr<M>(e, r.head_fg, r.head_bg);
+    if (r.head_x - 1 != e->lastx || y != e->lasty)
+      move_cursor(e, r.head_x, y);
+    encoder_mark_head(e, r.head_x, y);
+    bytebuffer_append(e->out, r.out->buf + r.head, r.out->len - r.head);
+
+    lock.lock();
+    struct rowcache_entry *n =
+        rowcache_insert(&_row_cache, hash, backrow, e->rowsave, w, y, mode);
+    memcpy(n->cells + 2 * w, frontrow, sizeof(struct tb_cell) * w);
+    bytebuffer_append(&n->bytes, r.out->buf + r.head, r.out->len - r.head);
+    n->head_x = r.head_x;
+    n->head_fg = r.head_fg;
+    n->head_bg = r.head_bg;
+    n->lastx = lastx = r.lastx;
+    n->lasty = lasty = r.lasty;
+    n->lastfg = fg = r.lastfg;
+    n->lastbg = bg = r.lastbg;
+#ifdef TB_STATS
+    n->moves = r.stats.cursor_moves - r.head_moves;
+    n->sgrs = r.stats.sgr_sequences - r.head_sgrs;
+    e->stats.cursor_moves += n->moves;
+    e->stats.sgr_sequences += n->sgrs;
+#endif
+  }
+
+  /* the row leaves the state its last cell does, whatever came before */
+  e->lastx = lastx;
+  e->lasty = lasty;
+  e->attr = map_attr<M>(fg, bg, e->colors);
+  e->attr_valid = true;
+  e->lastfg = fg;
+  e->lastbg = bg;
+}
+
+/* sends the cells of 'back_buf' which differ from the screen in the rows
+ * [top, bottom) flagged in 'dirty', clearing the flags */
+template <enum output_mode M>
+void termbox_impl::draw_rows(struct encoder *e, const struct cellbuf *back_buf,
+                             unsigned char *dirty, int top, int bottom) {
+  int y, nspans;
+  struct tb_cell *backrow, *frontrow;
+
+  for (y = top; y < bottom; ++y) {
+    if (!dirty[y])
+      continue;
+    dirty[y] = 0;
+    _scroll.stale[y] = ROWHASH_STALE;
+    backrow = &CELL(back_buf, 0, y);
+    frontrow = &CELL(&_front_buffer, 0, y);
+#ifdef TB_STATS
+    const uint64_t start = monotonic_ns();
+#endif
+    nspans = celldiff_row(backrow, frontrow, _front_buffer.width, e->spans);
+#ifdef TB_STATS
+    const uint64_t diffed = monotonic_ns();
+    e->stats.diff_ns += diffed - start;
+    e->stats.cells_scanned += _front_buffer.width;
+    e->stats.spans += nspans;
+    for (int s = 0; s < nspans; ++s)
+      e->stats.cells_changed += e->spans[s].end - e->spans[s].begin;
+#endif
+    if (nspans == 0)
+      continue;
+    if (_row_cache.cap)
+      draw_row_cached<M>(e, backrow, frontrow, y, nspans);
+    else
+      draw_row<M>(e, backrow, frontrow, y, nspans);
+#ifdef TB_STATS
+    e->stats.encode_ns += monotonic_ns() - diffed;
+#endif
+  }
+}
+
+/* the output mode is fixed for the frame, pick the emitter made for it.
+ * 'colors' is the mode the cells are given in, see map_attr(). */
+void termbox_impl::draw_rows(struct encoder *e, enum output_mode mode,
+                             enum output_mode colors,
+                             const struct cellbuf *back, unsigned char *dirty,
+                             int top, int bottom) {
+  encoder_select_mode(e, mode, colors);
+  switch (mode) {
+  case output_mode::mode256:
+    draw_rows<output_mode::mode256>(e, back, dirty, top, bottom);
+    break;
+  case output_mode::mode216:
+    draw_rows<output_mode::mode216>(e, back, dirty, top, bottom);
+    break;
+  case output_mode::grayscale:
+    draw_rows<output_mode::grayscale>(e, back, dirty, top, bottom);
+    break;
+  case output_mode::normal:
+  default:
+    draw_rows<output_mode::normal>(e, back, dirty, top, bottom);
+    break;
+  }
+}
+
+/* draws the dirty rows of a frame, split into bands drawn side by side by
+ * the encoder threads when there are enough changed cells.
+ *
+ * A band starts from a blank state, so only the attributes and the cursor
+ * motion of its first cell differ from what a single stream would have sent
+ * there: every cell sends its attributes before anything else, the cursor
+ * is placed before the cell, and neither depends on what came before once
+ * sent. Joining the bands redoes just that head from the state the band
+ * before left, which gives the very bytes drawing all rows in one go does. */
+void termbox_impl::draw_frame(const struct cellbuf *back,
+                              unsigned char *dirty, enum output_mode mode,
+                              enum output_mode colors) {
+  const int w = _front_buffer.width, h = _front_buffer.height;
+  int y, k, seen, ndirty = 0, nbands;
+
+  for (y = 0; y < h; ++y)
+    ndirty += dirty[y];
+  nbands = (int)_bands.size();
+  if (nbands > ndirty)
+    nbands = ndirty;
+  if (nbands > ndirty * w / ENCODE_BAND_MIN_CELLS)
+    nbands = ndirty * w / ENCODE_BAND_MIN_CELLS;
+  if (nbands < 2) {
+    draw_rows(&_enc, mode, colors, back, dirty, 0, h);
+    return;
+  }
+
+  /* about as many dirty rows in every band */
+  _bands[0].top = 0;
+  for (y = 0, k = 1, seen = 0; y < h; ++y) {
+    seen += dirty[y];
+    if (k < nbands && seen * nbands >= ndirty * k) {
+      _bands[k - 1].bottom = y + 1;
+      _bands[k].top = y + 1;
+      ++k;
+    }
+  }
+  _bands[nbands - 1].bottom = h;
+  for (k = 1; k < nbands; ++k) {
+    struct band *b = &_bands[k];
+    if (b->width != w) {
+      encoder_free(&b->enc);
+      encoder_init(&b->enc, &b->out, w);
+      b->width = w;
+    }
+    encoder_reset(&b->enc);
+    bytebuffer_clear(&b->out);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_band_lock);
+    _band_back = back;
+    _band_dirty = dirty;
+    _band_mode = mode;
+    _band_colors = colors;
+    _band_count = nbands;
+    _bands_left = nbands - 1;
+    ++_band_round;
+  }
+  _band_start.notify_all();
+  draw_rows(&_enc, mode, colors, back, dirty, _bands[0].top,
+            _bands[0].bottom);
+  {
+    std::unique_lock<std::mutex> lock(_band_lock);
+    _band_done.wait(lock, [this] { return _bands_left == 0; });
+  }
+
+  for (k = 1; k < nbands; ++k) {
+    struct band *b = &_bands[k];
+    const struct encoder *e = &b->enc;
+#ifdef TB_STATS
+    encoder_take_stats(&b->enc, &_enc.stats, false);
+#endif
+    if (e->head < 0)
+      continue;
+    send_attr(&_enc, mode, colors, e->head_fg, e->head_bg);
+    if (e->head_x - 1 != _enc.lastx || e->head_y != _enc.lasty)
+      move_cursor(&_enc, e->head_x, e->head_y);
+    send_ref(b->out.buf + e->head, b->out.len - e->head);
+    _enc.lastx = e->lastx;
+    _enc.lasty = e->lasty;
+    _enc.attr = e->attr;
+    _enc.attr_valid = e->attr_valid;
+    _enc.lastfg = e->lastfg;
+    _enc.lastbg = e->lastbg;
+  }
+}
+
+/* draws band 'band' of every round after 'round' */
+void termbox_impl::encode_loop(int band, unsigned round) {
+  std::unique_lock<std::mutex> lock(_band_lock);
+  for (;;) {
+    _band_start.wait(lock,
+                     [&] { return _band_round != round || _band_stop; });
+    if (_band_stop)
+      break;
+    round = _band_round;
+    if (band >= _band_count)
+      continue;
+    lock.unlock();
+
+    struct band *b = &_bands[band];
+    draw_rows(&b->enc, _band_mode, _band_colors, _band_back, _band_dirty,
+              b->top, b->bottom);
+
+    lock.lock();
+    if (--_bands_left == 0)
+      _band_done.notify_one();
+  }
+}
+
+void termbox11::clear() {
+  if (_impl->_buffer_size_change_request) {
+    _impl->update_size();
+    _impl->_buffer_size_change_request = 0;
+  }
+  cellbuf_clear(&_impl->_back_buffer, _impl->_foreground,
+                _impl->_background);
+  _impl->dirty_rows_mark(0, _impl->_back_buffer.height);
+}
+
+void termbox_impl::send_frame(struct frame *f) {
+  const struct cellbuf *back = &f->cells;
+  const int start = _output_buffer.len + _output_chain.len;
+  bool attrs;
+
+  /* a table too large to fill in right away is filled in by the first frame,
+   * before any encoder thread looks at it */
+  cuptab_build(&_cup);
+  if (_adapt)
+    adapt_output(f->mode);
+  const enum output_mode mode = adapt_mode(f->mode, _adapt_level, &attrs);
+  _drop_attrs = !attrs;
+  /* what was sent while stepped down stays on the screen until redrawn */
+  if (_adapt_repaint) {
+    _adapt_repaint = false;
+    memset(_front_buffer.cells, 0xFF,
+           sizeof(struct tb_cell) * _front_buffer.width * _front_buffer.height);
+    memset(f->dirty, 1, _front_buffer.height);
+  }
+
+  /* invalidate cursor position */
+  _enc.lastx = LAST_COORD_INIT;
+  _enc.lasty = LAST_COORD_INIT;
+
+  if (f->sync)
+    bytebuffer_puts(&_output_buffer, SYNC_OUTPUT_BEGIN);
+
+#ifdef TB_STATS
+  /* the last frame is over, the writes since went to it */
+  stats_take_io();
+  frame_stats_add(&_stats_total, &_stats_last);
+  _stats_last = frame_stats();
+  _stats_last.frames = 1;
+  const uint64_t scan = monotonic_ns();
+#endif
+  send_scroll(back, f->dirty);
+#ifdef TB_STATS
+  _enc.stats.diff_ns += monotonic_ns() - scan;
+#endif
+  draw_frame(back, f->dirty, mode, f->mode);
+
+  /* set_cursor() shows and hides the cursor right away, except with the
+   * render thread which leaves that to the frame */
+  const bool hidden = IS_CURSOR_HIDDEN(f->cursor_x, f->cursor_y);
+  if (hidden != _cursor_hidden) {
+    bytebuffer_puts(&_output_buffer,
+                    _caps->funcs[hidden ? T_HIDE_CURSOR : T_SHOW_CURSOR]);
+    _cursor_hidden = hidden;
+  }
+  if (!hidden)
+    move_cursor(&_enc, f->cursor_x, f->cursor_y);
+  if (f->sync)
+    bytebuffer_puts(&_output_buffer, SYNC_OUTPUT_END);
+  _adapt_sent += _output_buffer.len + _output_chain.len - start;
+#ifdef TB_STATS
+  encoder_take_stats(&_enc, &_stats_last, true);
+#endif
+}
+
+/* samples the link before a frame is sent in 'mode': steps the output down
+ * while more is queued than 'max_queue', or the link takes it slower than
+ * 'min_rate', and back up once the queue stayed low for 'recover_ms'. A
+ * step up the link does not keep up with doubles that wait for the next.
+ *
+ * The queue is the tty's, which a pty does not report, and in asynchronous
+ * mode the part of the output buffer not written yet. The rate is that of
+ * the writes which had to wait for the link, see write_output() and
+ * drain_output(), or else of the queue draining, which is only known as
+ * long as it did not run dry. */
+void termbox_impl::adapt_output(enum output_mode mode) {
+  const uint64_t now = monotonic_ns();
+  int queued = 0;
+#ifdef TIOCOUTQ
+  ioctl(_inout, TIOCOUTQ, &queued);
+#endif
+  if (_async_output)
+    queued += _output_buffer.len;
+
+  const int levels = adapt_levels(mode);
+  if (_adapt_level > levels)
+    _adapt_level = levels;
+  int level = _adapt_level;
+  if (_adapt_last && now > _adapt_last) {
+    const int64_t drained = (int64_t)_adapt_queued + _adapt_sent - queued;
+    uint64_t rate = UINT64_MAX;
+    if (_adapt_write_ns >= ADAPT_BLOCK_NS &&
+        _adapt_written >= _adaptation.max_queue)
+      rate = _adapt_written * 1000000000 / _adapt_write_ns;
+    else if (queued > 0)
+      rate = drained > 0 ? (uint64_t)drained * 1000000000 / (now - _adapt_last)
+                         : 0;
+    const bool slow = rate < _adaptation.min_rate;
+    const bool settled = now - _adapt_changed_at >= ADAPT_STEP_NS;
+    const uint64_t recover =
+        (uint64_t)_adaptation.recover_ms * 1000000 * _adapt_backoff;
+
+    if ((size_t)queued > _adaptation.max_queue || slow) {
+      _adapt_clear_since = 0;
+      if (level < levels && settled) {
+        if (_adapt_stepped_up && now - _adapt_changed_at < recover &&
+            _adapt_backoff < 8)
+          _adapt_backoff *= 2;
+        _adapt_stepped_up = false;
+        ++level;
+      }
+    } else if ((size_t)queued <= _adaptation.max_queue / 4) {
+      if (!_adapt_clear_since)
+        _adapt_clear_since = now;
+      if (now - _adapt_clear_since >= recover) {
+        /* the step before held, the link cleared */
+        if (_adapt_stepped_up)
+          _adapt_backoff = 1;
+        if (level > 0 && settled) {
+          --level;
+          _adapt_stepped_up = true;
+          _adapt_clear_since = now;
+          _adapt_repaint = true;
+        }
+      }
+    } else {
+      _adapt_clear_since = 0;
+    }
+  }
+  _adapt_last = now;
+  _adapt_queued = queued;
+  _adapt_sent = 0;
+  _adapt_written = 0;
+  _adapt_write_ns = 0;
+
+  if (level != _adapt_level) {
+    _adapt_level = level;
+    _adapt_changed_at = now;
+    std::lock_guard<std::mutex> lock(_adapt_lock);
+    _adapt_report_mode = adapt_mode(mode, level, &_adapt_report_attrs);
+    _adapt_report = true;
+  }
+}
+
+/* hands the last step of the bandwidth adaptation to the callback, on the
+ * caller's thread */
+void termbox_impl::report_adaptation(void) {
+  std::unique_lock<std::mutex> lock(_adapt_lock);
+  if (!_adapt_report)
+    return;
+  _adapt_report = false;
+  const enum output_mode mode = _adapt_report_mode;
+  const bool attrs = _adapt_report_attrs;
+  lock.unlock();
+  if (_adaptation.changed)
+    _adaptation.changed(mode, attrs);
+}
+
+/* appends 'len' bytes at 'data' to the output, which has to be flushed
+ * before they change. Big blocks are not copied but written from where they
+ * are, except in asynchronous mode where the output may wait longer. Only
+ * the band join of draw_frame() sends through here. */
+void termbox_impl::send_ref(const char *data, int len) {
+  if (_async_output)
+    bytebuffer_append(&_output_buffer, data, len);
+  else
+    iochain_ref(&_output_chain, &_output_buffer, data, len);
+}
+
+/* sends the output buffer, as far as the terminal takes it right now in
+ * asynchronous mode */
+void termbox_impl::flush_output(void) {
+  if (_async_output)
+    drain_output();
+  else
+    write_output();
+}
+
+/* the headless sink takes all of every write */
+static ssize_t headless_writev(void *ctx, int fd, const struct iovec *iov,
+                               int n) {
+  (void)fd;
+  const headless_io *io = (const headless_io *)ctx;
+  ssize_t len = 0;
+  for (int i = 0; i < n; ++i) {
+    const char *data = (const char *)iov[i].iov_base;
+    if (io->buffer)
+      io->buffer->append(data, iov[i].iov_len);
+    else if (io->output)
+      io->output(data, iov[i].iov_len);
+    len += iov[i].iov_len;
+  }
+  return len;
+}
+
+/* writes the output buffer and what it references, blocking */
+void termbox_impl::write_chain(void) {
+#ifdef TB_STATS
+  const uint64_t start = monotonic_ns();
+#endif
+  if (_headless)
+    iochain_flush_with(&_output_chain, &_output_buffer, -1, headless_writev,
+                       &_headless_io, STATS_IO);
+  else if (_ring.fd >= 0 && !_render_running)
+    iochain_flush_with(&_output_chain, &_output_buffer, _inout, uring_writev,
+                       &_ring, STATS_IO);
+  else
+    iochain_flush(&_output_chain, &_output_buffer, _inout, STATS_IO);
+#ifdef TB_STATS
+  _stats_last.flush_ns += monotonic_ns() - start;
+#endif
+}
+
+/* writes the output buffer out, blocking, timing the write for the
+ * bandwidth adaptation */
+void termbox_impl::write_output(void) {
+  if (!_adapt) {
+    write_chain();
+    return;
+  }
+  const int len = _output_buffer.len + _output_chain.len;
+  const uint64_t start = monotonic_ns();
+  write_chain();
+  _adapt_write_ns += monotonic_ns() - start;
+  _adapt_written += len;
+}
+
+/* writes as much of the output buffer as the terminal takes right away */
+void termbox_impl::write_some(void) {
+  if (_headless) {
+    write_chain();
+    return;
+  }
+#ifdef TB_STATS
+  const uint64_t start = monotonic_ns();
+#endif
+  bytebuffer_flush_some(&_output_buffer, _inout, STATS_IO);
+#ifdef TB_STATS
+  _stats_last.flush_ns += monotonic_ns() - start;
+#endif
+}
+
+#ifdef TB_STATS
+/* adds the writes since the last call to the last frame */
+void termbox_impl::stats_take_io(void) {
+  _stats_last.bytes_written += _stats_io.bytes;
+  _stats_last.writes += _stats_io.writes;
+  _stats_last.short_writes += _stats_io.short_writes;
+  _stats_io = iostats();
+}
+#endif
+
+void termbox_impl::drain_output(void) {
+  write_some();
+  if (_output_buffer.len == 0 && _frame_pending) {
+    _frame_pending = false;
+    /* a frame had to wait, the link was busy writing the last one all along
+     * since it was sent */
+    if (_adapt) {
+      _adapt_written += _adapt_sent;
+      _adapt_write_ns += monotonic_ns() - _adapt_last;
+    }
+    send_frame(&_pending);
+    write_some();
+  }
+}
+
+/* sends a frame captured from the back buffer, or queues it where the other
+ * output modes keep frames waiting. 'f' gets what it replaced, returns
+ * whether it still holds its own frame. */
+bool termbox_impl::submit_frame(struct frame *f) {
+  /* hand the frame over to the render thread, replacing the one waiting if
+   * the thread did not get to it yet */
+  if (_render_running) {
+    {
+      std::lock_guard<std::mutex> lock(_frame_lock);
+      if (_frame_ready)
+        frame_merge_dirty(f, &_frames[_ready]);
+      std::swap(*f, _frames[_ready]);
+      _frame_ready = true;
+    }
+    _frame_cond.notify_one();
+    return false;
+  }
+
+  if (_async_output && _output_buffer.len > 0) {
+    if (_frame_pending)
+      frame_merge_dirty(f, &_pending);
+    std::swap(*f, _pending);
+    _frame_pending = true;
+    drain_output();
+    return false;
+  }
+
+  send_frame(f);
+  flush_output();
+  return true;
+}
+
+/* sends the paced frame if the interval since the last one is over */
+void termbox_impl::pace_frames(void) {
+  const uint64_t now = monotonic_ns();
+  if (!_paced_pending || now < _next_frame)
+    return;
+  _paced_pending = false;
+  _next_frame = now + _frame_interval;
+  _paced_cells = submit_frame(&_paced);
+}
+
+void termbox_impl::render_loop(void) {
+  std::unique_lock<std::mutex> lock(_frame_lock);
+  for (;;) {
+    _frame_cond.wait(lock, [this] { return _frame_ready || _render_stop; });
+    /* the last frame presented is sent before stopping */
+    if (!_frame_ready)
+      break;
+    std::swap(_ready, _rendering);
+    _frame_ready = false;
+    _render_busy = true;
+    lock.unlock();
+
+    {
+      std::lock_guard<std::mutex> out(_output_lock);
+      struct frame *f = &_frames[_rendering];
+      /* frames taken before a resize are dropped, every row is redrawn
+       * after it anyway */
+      if (f->cells.width == _front_buffer.width &&
+          f->cells.height == _front_buffer.height) {
+        send_frame(f);
+        write_output();
+      }
+    }
+
+    lock.lock();
+    _render_busy = false;
+  }
+}
+
+void termbox11::present() {
+  if (_impl->_buffer_size_change_request) {
+    _impl->update_size();
+    _impl->_buffer_size_change_request = false;
+  }
+  if (_impl->_adapt)
+    _impl->report_adaptation();
+
+  /* frames presented within an interval of the last one sent are merged
+   * and go out when it is over */
+  if (_impl->_frame_interval) {
+    _impl->frame_capture(&_impl->_paced, _impl->_paced_pending,
+                         _impl->_paced_cells);
+    _impl->_paced_cells = true;
+    _impl->_paced.sync = sync_output();
+    _impl->_paced.mode = _impl->_outputmode;
+    _impl->_paced_pending = true;
+    _impl->pace_frames();
+    return;
+  }
+  /* the rows sent from here on are not flagged for the paced frame */
+  _impl->_paced_cells = false;
+
+  if (_impl->_render_running) {
+    struct frame *f = &_impl->_frames[_impl->_fill];
+    _impl->frame_capture(f, false, false);
+    f->sync = sync_output();
+    f->mode = _impl->_outputmode;
+    _impl->submit_frame(f);
+    return;
+  }
+
+  /* the terminal has not taken the previous frame yet: keep this one as the
+   * next to send, replacing any other waiting, and let the event loop send
+   * it once the queue drained */
+  if (_impl->_async_output && _impl->_output_buffer.len > 0) {
+    _impl->frame_capture(&_impl->_pending, _impl->_frame_pending, false);
+    _impl->_pending.sync = sync_output();
+    _impl->_pending.mode = _impl->_outputmode;
+    _impl->_frame_pending = true;
+    _impl->drain_output();
+    return;
+  }
+
+  struct frame f = {_impl->_back_buffer, _impl->_dirty_rows,
+                    _impl->_cursor_x, _impl->_cursor_y, sync_output(),
+                    _impl->_outputmode};
+  _impl->send_frame(&f);
+  _impl->flush_output();
+}
+
 event_type termbox11::poll_event(struct tb_event *event) {
   return _impl->wait_fill_event(event, 0);
 }
@@ -635,16 +2666,22 @@ event_type termbox11::peek_event(struct tb_event *event, int timeout) {
 }
 
 void termbox11::set_cursor(int cx, int cy) {
-  if (IS_CURSOR_HIDDEN(cursor_x, cursor_y) && !IS_CURSOR_HIDDEN(cx, cy))
-    bytebuffer_puts(&_impl->_output_buffer, funcs[T_SHOW_CURSOR]);
-
-  if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y) && IS_CURSOR_HIDDEN(cx, cy))
-    bytebuffer_puts(&_impl->_output_buffer, funcs[T_HIDE_CURSOR]);
+  _impl->_cursor_x = cx;
+  _impl->_cursor_y = cy;
+  /* the render thread moves the cursor along with the next frame */
+  if (_impl->_render_running)
+    return;
 
-  cursor_x = cx;
-  cursor_y = cy;
-  if (!IS_CURSOR_HIDDEN(cursor_x, cursor_y))
-    _impl->write_cursor(cursor_x, cursor_y);
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
+  const char **funcs = _impl->_caps->funcs;
+  const bool hidden = IS_CURSOR_HIDDEN(cx, cy);
+  if (hidden != _impl->_cursor_hidden) {
+    bytebuffer_puts(&_impl->_output_buffer,
+                    funcs[hidden ? T_HIDE_CURSOR : T_SHOW_CURSOR]);
+    _impl->_cursor_hidden = hidden;
+  }
+  if (!hidden)
+    _impl->write_cursor(&_impl->_enc, cx, cy);
 }
 
 void termbox11::select_input_mode(struct input_mode mode) {
@@ -657,18 +2694,215 @@ void termbox11::select_input_mode(struct input_mode mode) {
     mode.alt = false;
 
   _impl->_inputmode = mode;
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
+  const char **funcs = _impl->_caps->funcs;
   if (mode.mouse) {
     bytebuffer_puts(&_impl->_output_buffer, funcs[T_ENTER_MOUSE]);
-    bytebuffer_flush(&_impl->_output_buffer, inout);
+    _impl->flush_output();
   } else {
     bytebuffer_puts(&_impl->_output_buffer, funcs[T_EXIT_MOUSE]);
-    bytebuffer_flush(&_impl->_output_buffer, inout);
+    _impl->flush_output();
   }
 }
 input_mode termbox11::input_mode() { return _impl->_inputmode; }
 
 void termbox11::select_output_mode(enum output_mode mode) {
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
   _impl->_outputmode = mode;
 }
 
 output_mode termbox11::output_mode() { return _impl->_outputmode; }
+
+void termbox11::select_sync_output(bool enable) {
+  _impl->_sync_output = enable;
+  /* the answer is picked up by the input parser whenever it arrives, no
+   * point in waiting for it here */
+  if (enable && !_impl->_sync_queried) {
+    std::lock_guard<std::mutex> lock(_impl->_output_lock);
+    _impl->_sync_queried = true;
+    bytebuffer_puts(&_impl->_output_buffer, SYNC_OUTPUT_QUERY);
+    _impl->flush_output();
+  }
+}
+
+bool termbox11::sync_output() {
+  return _impl->_sync_output && _impl->_input.sync_output_supported;
+}
+
+void termbox11::select_async_output(bool enable) {
+  if (enable == _impl->_async_output)
+    return;
+  if (enable)
+    select_render_thread(false);
+
+  /* a headless sink takes everything at once anyway */
+  const int flags = _impl->_headless ? 0 : fcntl(_impl->_inout, F_GETFL);
+  if (enable) {
+    if (!_impl->_headless)
+      fcntl(_impl->_inout, F_SETFL, flags | O_NONBLOCK);
+    _impl->_async_output = true;
+    return;
+  }
+
+  if (!_impl->_headless)
+    fcntl(_impl->_inout, F_SETFL, flags & ~O_NONBLOCK);
+  _impl->_async_output = false;
+  if (_impl->_frame_pending) {
+    _impl->_frame_pending = false;
+    _impl->send_frame(&_impl->_pending);
+  }
+  _impl->flush_output();
+}
+
+bool termbox11::async_output() { return _impl->_async_output; }
+
+void termbox11::select_render_thread(bool enable) {
+  if (enable == _impl->_render_running)
+    return;
+
+  if (enable) {
+    select_async_output(false);
+    _impl->_render_stop = false;
+    _impl->_render_running = true;
+    _impl->_render_thread = std::thread(&termbox_impl::render_loop, _impl.get());
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(_impl->_frame_lock);
+    _impl->_render_stop = true;
+  }
+  _impl->_frame_cond.notify_one();
+  _impl->_render_thread.join();
+  _impl->_render_running = false;
+}
+
+bool termbox11::render_thread() { return _impl->_render_running; }
+
+void termbox11::select_encode_threads(int n) {
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
+  int i;
+
+  if (n < 1)
+    n = 1;
+  if (n == encode_threads())
+    return;
+
+  {
+    std::lock_guard<std::mutex> bands(_impl->_band_lock);
+    _impl->_band_stop = true;
+  }
+  _impl->_band_start.notify_all();
+  for (auto &t : _impl->_encode_threads)
+    t.join();
+  _impl->_encode_threads.clear();
+  for (auto &b : _impl->_bands) {
+    encoder_free(&b.enc);
+    bytebuffer_free(&b.out);
+  }
+  _impl->_bands.clear();
+  _impl->_band_stop = false;
+  if (n == 1)
+    return;
+
+  /* band 0 goes to the terminal stream directly and needs no buffer */
+  _impl->_bands.resize(n);
+  for (i = 1; i < n; ++i) {
+    struct band *b = &_impl->_bands[i];
+    *b = band();
+    bytebuffer_init(&b->out, 32 * 1024);
+  }
+  /* the round is taken here, a thread starting late would miss the first
+   * one otherwise and leave the frame waiting for it */
+  for (i = 1; i < n; ++i)
+    _impl->_encode_threads.emplace_back(&termbox_impl::encode_loop,
+                                        _impl.get(), i, _impl->_band_round);
+}
+
+int termbox11::encode_threads() {
+  return (int)_impl->_encode_threads.size() + 1;
+}
+
+void termbox11::select_row_cache(int entries) {
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
+  std::lock_guard<std::mutex> cache(_impl->_cache_lock);
+  rowcache_free(&_impl->_row_cache);
+  rowcache_init(&_impl->_row_cache, entries);
+}
+
+int termbox11::row_cache() { return _impl->_row_cache.cap; }
+
+row_cache_stats termbox11::row_cache_stats() {
+  std::lock_guard<std::mutex> lock(_impl->_cache_lock);
+  ::row_cache_stats stats;
+  stats.hits = _impl->_row_cache.hits;
+  stats.misses = _impl->_row_cache.misses;
+  return stats;
+}
+
+bool termbox11::output_pending() {
+  if (_impl->_paced_pending)
+    return true;
+  /* the output buffer belongs to the render thread while it runs */
+  if (_impl->_render_running) {
+    std::lock_guard<std::mutex> lock(_impl->_frame_lock);
+    return _impl->_frame_ready || _impl->_render_busy;
+  }
+  return _impl->_output_buffer.len > 0 || _impl->_frame_pending;
+}
+
+void termbox11::select_frame_rate(int fps) {
+  _impl->_frame_interval = fps > 0 ? 1000000000 / fps : 0;
+  /* whatever waits for its turn goes out now */
+  if (!_impl->_frame_interval && _impl->_paced_pending) {
+    _impl->_next_frame = 0;
+    _impl->pace_frames();
+  }
+}
+
+int termbox11::frame_rate() {
+  return _impl->_frame_interval ? (int)(1000000000 / _impl->_frame_interval)
+                                : 0;
+}
+
+void termbox11::select_adaptive_output(bool enable,
+                                       const output_adaptation &config) {
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
+  _impl->_adapt = enable;
+  _impl->_adaptation = config;
+  _impl->_adapt_last = 0;
+  _impl->_adapt_clear_since = 0;
+  _impl->_adapt_backoff = 1;
+  _impl->_adapt_stepped_up = false;
+  /* back to full output, redrawing what was sent stepped down */
+  if (!enable && _impl->_adapt_level) {
+    _impl->_adapt_level = 0;
+    _impl->_adapt_repaint = true;
+  }
+  std::lock_guard<std::mutex> report(_impl->_adapt_lock);
+  _impl->_adapt_report = false;
+}
+
+bool termbox11::adaptive_output() { return _impl->_adapt; }
+
+frame_stats termbox11::last_frame_stats() {
+#ifdef TB_STATS
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
+  _impl->stats_take_io();
+  return _impl->_stats_last;
+#else
+  return ::frame_stats();
+#endif
+}
+
+frame_stats termbox11::total_frame_stats() {
+#ifdef TB_STATS
+  std::lock_guard<std::mutex> lock(_impl->_output_lock);
+  _impl->stats_take_io();
+  ::frame_stats stats = _impl->_stats_total;
+  frame_stats_add(&stats, &_impl->_stats_last);
+  return stats;
+#else
+  return ::frame_stats();
+#endif
+}
@@ -0,0 +1,346 @@
+// io_uring backend for the tty. Waiting for input takes a select() and a
+// read() otherwise; here a poll of the tty linked to a read of it stays
+// queued in the ring, so a single io_uring_enter() both waits and gets the
+// input, and whatever was queued since, a write or the polls to rearm, goes
+// in with it. Completions are picked up from the shared ring without a
+// system call at all.
+//
+// The ring is set up with raw system calls, not liburing, and needs the
+// extended arguments of io_uring_enter() for its timeout (Linux 5.11).
+// uring_init() fails where they are missing, the caller falls back on the
+// standard backend then.
+
+#if defined(__linux__) && __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(IORING_FEAT_EXT_ARG) && defined(__NR_io_uring_setup)
+#define URING_SUPPORTED 1
+#endif
+
+#define URING_ENTRIES 16
+#define URING_READ_SIZE 4096
+
+// what a completion is for
+enum {
+	URING_POLL_IN = 1,
+	URING_READ,
+	URING_POLL_WINCH,
+	URING_POLL_OUT,
+	URING_WRITE,
+};
+
+struct uring {
+	int fd{-1}; // -1 when not set up
+	struct bytebuffer *in{nullptr}; // where input goes
+#ifdef URING_SUPPORTED
+	unsigned *sq_head{nullptr};
+	unsigned *sq_tail{nullptr};
+	unsigned sq_mask{0};
+	unsigned *sq_array{nullptr};
+	struct io_uring_sqe *sqes{nullptr};
+	unsigned queued{0}; // entries filled in but not submitted yet
+	unsigned *cq_head{nullptr};
+	unsigned *cq_tail{nullptr};
+	unsigned cq_mask{0};
+	struct io_uring_cqe *cqes{nullptr};
+	void *sq_ring{nullptr};
+	size_t sq_ring_size{0};
+	void *cq_ring{nullptr};
+	size_t cq_ring_size{0};
+	size_t sqes_size{0};
+	char *rbuf{nullptr};
+#endif
+	// requests in flight
+	bool input_armed{false};
+	bool winch_armed{false};
+	bool out_armed{false};
+	// what came back since the caller last looked: bytes of input appended,
+	// the errno of a failed read, the signal pipe or the tty for output
+	// becoming ready, and the result of the last write
+	int input{0};
+	int error{0};
+	bool winch{false};
+	bool writable{false};
+	bool written{false};
+	int write_res{0};
+};
+
+#ifdef URING_SUPPORTED
+
+static int uring_init(struct uring *r, struct bytebuffer *in) {
+	struct io_uring_params p;
+	*r = uring();
+	memset(&p, 0, sizeof(p));
+	r->in = in;
+	r->fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (r->fd < 0) {
+		r->fd = -1;
+		return -1;
+	}
+	if (!(p.features & IORING_FEAT_EXT_ARG))
+		goto fail;
+
+	r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	r->cq_ring_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+	r->sq_ring = mmap(0, r->sq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (r->sq_ring == MAP_FAILED) {
+		r->sq_ring = NULL;
+		goto fail;
+	}
+	r->cq_ring = mmap(0, r->cq_ring_size, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+	if (r->cq_ring == MAP_FAILED) {
+		r->cq_ring = NULL;
+		goto fail;
+	}
+	r->sqes = (struct io_uring_sqe *)mmap(0, r->sqes_size,
+					      PROT_READ | PROT_WRITE,
+					      MAP_SHARED | MAP_POPULATE, r->fd,
+					      IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		r->sqes = NULL;
+		goto fail;
+	}
+
+	r->sq_head = (unsigned *)((char *)r->sq_ring + p.sq_off.head);
+	r->sq_tail = (unsigned *)((char *)r->sq_ring + p.sq_off.tail);
+	r->sq_mask = *(unsigned *)((char *)r->sq_ring + p.sq_off.ring_mask);
+	r->sq_array = (unsigned *)((char *)r->sq_ring + p.sq_off.array);
+	r->cq_head = (unsigned *)((char *)r->cq_ring + p.cq_off.head);
+	r->cq_tail = (unsigned *)((char *)r->cq_ring + p.cq_off.tail);
+	r->cq_mask = *(unsigned *)((char *)r->cq_ring + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *)((char *)r->cq_ring + p.cq_off.cqes);
+	r->rbuf = (char *)malloc(URING_READ_SIZE);
+	assert(r->rbuf);
+	return 0;
+
+fail:
+	if (r->sq_ring)
+		munmap(r->sq_ring, r->sq_ring_size);
+	if (r->cq_ring)
+		munmap(r->cq_ring, r->cq_ring_size);
+	close(r->fd);
+	*r = uring();
+	return -1;
+}
+
+// closing the ring cancels the requests still in flight
+static void uring_free(struct uring *r) {
+	if (r->fd < 0)
+		return;
+	munmap(r->sqes, r->sqes_size);
+	munmap(r->cq_ring, r->cq_ring_size);
+	munmap(r->sq_ring, r->sq_ring_size);
+	close(r->fd);
+	free(r->rbuf);
+	*r = uring();
+}
+
+// submits what is queued and waits for 'min_complete' completions, for at
+// most 'ts' if not NULL
+static int uring_enter(struct uring *r, unsigned min_complete,
+		       struct __kernel_timespec *ts) {
+	struct io_uring_getevents_arg arg;
+	unsigned flags = min_complete ? IORING_ENTER_GETEVENTS : 0;
+	memset(&arg, 0, sizeof(arg));
+	arg.ts = (uint64_t)(uintptr_t)ts;
+	if (ts)
+		flags |= IORING_ENTER_EXT_ARG;
+	int n = (int)syscall(__NR_io_uring_enter, r->fd, r->queued, min_complete,
+			     flags, ts ? (void *)&arg : NULL,
+			     ts ? sizeof(arg) : 0);
+	if (n > 0)
+		r->queued -= (unsigned)n < r->queued ? (unsigned)n : r->queued;
+	return n;
+}
+
+static struct io_uring_sqe *uring_sqe(struct uring *r, uint64_t tag) {
+	unsigned tail = *r->sq_tail;
+	// a full ring has to go out first, nothing waits on it
+	if (tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE) > r->sq_mask)
+		uring_enter(r, 0, NULL);
+	struct io_uring_sqe *sqe = &r->sqes[tail & r->sq_mask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = tag;
+	r->sq_array[tail & r->sq_mask] = tail & r->sq_mask;
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+	r->queued++;
+	return sqe;
+}
+
+static void uring_poll(struct uring *r, int fd, short events, uint64_t tag,
+		       bool link) {
+	struct io_uring_sqe *sqe = uring_sqe(r, tag);
+	sqe->opcode = IORING_OP_POLL_ADD;
+	sqe->fd = fd;
+	sqe->poll_events = events;
+	if (link)
+		sqe->flags = IOSQE_IO_LINK;
+}
+
+// queues what the caller waits for which is not in flight yet: input on the
+// tty and the signal pipe, and the tty taking output if 'out'
+static void uring_arm(struct uring *r, int fd, int winch_fd, bool out) {
+	if (!r->input_armed) {
+		// the tty returns at once with nothing to read, so the read waits
+		// for a poll
+		uring_poll(r, fd, POLLIN, URING_POLL_IN, true);
+		struct io_uring_sqe *sqe = uring_sqe(r, URING_READ);
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->off = (uint64_t)-1;
+		sqe->addr = (uint64_t)(uintptr_t)r->rbuf;
+		sqe->len = URING_READ_SIZE;
+		r->input_armed = true;
+	}
+	if (!r->winch_armed) {
+		uring_poll(r, winch_fd, POLLIN, URING_POLL_WINCH, false);
+		r->winch_armed = true;
+	}
+	if (out && !r->out_armed) {
+		uring_poll(r, fd, POLLOUT, URING_POLL_OUT, false);
+		r->out_armed = true;
+	}
+}
+
+// picks up the completions there are
+static void uring_reap(struct uring *r) {
+	unsigned head = *r->cq_head;
+	const unsigned tail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+	for (; head != tail; ++head) {
+		const struct io_uring_cqe *cqe = &r->cqes[head & r->cq_mask];
+		const int res = cqe->res;
+		switch (cqe->user_data) {
+		case URING_POLL_IN:
+			// a failed poll fails the read linked to it as well
+			if (res < 0 && res != -ECANCELED && res != -EINTR)
+				r->error = -res;
+			break;
+		case URING_READ:
+			r->input_armed = false;
+			if (res > 0) {
+				bytebuffer_append(r->in, r->rbuf, res);
+				r->input += res;
+			} else if (res < 0 && res != -ECANCELED && res != -EAGAIN &&
+				   res != -EINTR && !r->error) {
+				r->error = -res;
+			}
+			break;
+		case URING_POLL_WINCH:
+			r->winch_armed = false;
+			r->winch = true;
+			break;
+		case URING_POLL_OUT:
+			r->out_armed = false;
+			r->writable = true;
+			break;
+		case URING_WRITE:
+			r->written = true;
+			r->write_res = res;
+			break;
+		}
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// waits up to 'tv' for anything uring_arm() asked for, taking the time
+// waited off 'tv' like select() does. Returns 0 on timeout, -1 with errno
+// set if interrupted or failed.
+static int uring_wait(struct uring *r, struct timeval *tv) {
+	struct __kernel_timespec ts;
+	struct timespec start, end;
+	int n;
+
+	uring_reap(r);
+	if (r->input || r->error || r->winch || r->writable)
+		return 1;
+
+	if (tv) {
+		ts.tv_sec = tv->tv_sec;
+		ts.tv_nsec = tv->tv_usec * 1000;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+	}
+	n = uring_enter(r, 1, tv ? &ts : NULL);
+	if (tv) {
+		clock_gettime(CLOCK_MONOTONIC, &end);
+		int64_t left = ((int64_t)tv->tv_sec * 1000000 + tv->tv_usec) -
+			       ((int64_t)(end.tv_sec - start.tv_sec) * 1000000 +
+				(end.tv_nsec - start.tv_nsec) / 1000);
+		if (left < 0)
+			left = 0;
+		tv->tv_sec = left / 1000000;
+		tv->tv_usec = left % 1000000;
+	}
+	uring_reap(r);
+	if (r->input || r->error || r->winch || r->writable)
+		return 1;
+	if (n < 0 && errno == ETIME)
+		return 0;
+	if (n < 0)
+		return -1;
+	// a completion nobody waits for, a read which came back empty
+	errno = EINTR;
+	return -1;
+}
+
+// writev() through the ring, submitted along with whatever else is queued
+static ssize_t uring_writev(void *ctx, int fd, const struct iovec *iov,
+			    int n) {
+	struct uring *r = (struct uring *)ctx;
+	struct io_uring_sqe *sqe = uring_sqe(r, URING_WRITE);
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = fd;
+	sqe->off = (uint64_t)-1;
+	sqe->addr = (uint64_t)(uintptr_t)iov;
+	sqe->len = n;
+	r->written = false;
+	while (!r->written) {
+		if (uring_enter(r, 1, NULL) < 0 && errno != EINTR)
+			return -1;
+		// what else comes back meanwhile is kept for the next wait
+		uring_reap(r);
+	}
+	if (r->write_res < 0) {
+		errno = -r->write_res;
+		return -1;
+	}
+	return r->write_res;
+}
+
+#else
+
+static int uring_init(struct uring *r, struct bytebuffer *in) {
+	*r = uring();
+	r->in = in;
+	errno = ENOSYS;
+	return -1;
+}
+
+static void uring_free(struct uring *r) { (void)r; }
+
+static void uring_arm(struct uring *r, int fd, int winch_fd, bool out) {
+	(void)r, (void)fd, (void)winch_fd, (void)out;
+}
+
+static void uring_reap(struct uring *r) { (void)r; }
+
+static int uring_wait(struct uring *r, struct timeval *tv) {
+	(void)r, (void)tv;
+	errno = ENOSYS;
+	return -1;
+}
+
+static ssize_t uring_writev(void *ctx, int fd, const struct iovec *iov,
+			    int n) {
+	(void)ctx, (void)fd, (void)iov, (void)n;
+	errno = ENOSYS;
+	return -1;
+}
+
+#endif
@@ -0,0 +1,224 @@
+/* Instances created and destroyed on several threads at once, each on a
+ * pseudo-terminal of its own, while SIGWINCH keeps arriving. Every instance
+ * alive has to see the resize of its own terminal, and none of the handler's
+ * wakeups may go to a pipe being closed. Each then draws a pattern and a
+ * cursor of its own over a few frames; what its terminal receives is fed to
+ * the screen model of vt.h, which has to show that instance's back buffer
+ * and cursor after every frame. Exits with 1 on a missed resize or a
+ * difference.
+ *
+ * usage: instances_test [threads rounds]
+ */
+#include "termbox.h"
+#include "vt.h"
+#include <atomic>
+#include <fcntl.h>
+#include <mutex>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <sys/ioctl.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+#define FRAMES 4
+
+static std::atomic<bool> done{false};
+static std::atomic<int> failures{0};
+
+/* the master side of a pseudo-terminal, read as the instance writes to the
+ * slave so that a large frame never blocks it */
+struct pane {
+  int master;
+  std::mutex lock;
+  std::string bytes;
+  std::atomic<bool> done{false};
+  std::thread reader;
+};
+
+static void set_size(int fd, int w, int h) {
+  struct winsize ws;
+  memset(&ws, 0, sizeof(ws));
+  ws.ws_col = w;
+  ws.ws_row = h;
+  ioctl(fd, TIOCSWINSZ, &ws);
+}
+
+/* SIGWINCH to the process, as fast as it goes */
+static void storm() {
+  while (!done) {
+    kill(getpid(), SIGWINCH);
+    usleep(100);
+  }
+}
+
+static void drain(struct pane *p) {
+  char buf[4096];
+  while (!p->done) {
+    ssize_t n;
+    {
+      std::lock_guard<std::mutex> lock(p->lock);
+      n = read(p->master, buf, sizeof(buf));
+      if (n > 0)
+        p->bytes.append(buf, n);
+    }
+    if (n <= 0)
+      usleep(200);
+  }
+}
+
+/* feeds everything written to the slave so far to 'm' */
+static void sync(struct pane *p, struct vt &m) {
+  std::lock_guard<std::mutex> lock(p->lock);
+  char buf[4096];
+  ssize_t n;
+  while ((n = read(p->master, buf, sizeof(buf))) > 0)
+    p->bytes.append(buf, n);
+  m.feed(p->bytes);
+  p->bytes.clear();
+}
+
+/* whether 'tb' reports a resize to 'w' by 'h' within a second; the storm
+ * brings resizes to the sizes before as well */
+static bool resized_to(termbox11 *tb, int w, int h) {
+  for (int i = 0; i < 100; i++) {
+    struct tb_event ev;
+    if (tb->peek_event(&ev, 10) == event_type::resize && ev.w == w &&
+        ev.h == h)
+      return true;
+  }
+  return false;
+}
+
+/* frame 'f' of thread 'index': all of the screen first, then every third
+ * cell, in letters and colours no other thread draws at the same place */
+static void draw(termbox11 *tb, int index, int f) {
+  const int w = tb->width(), h = tb->height();
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      if (f > 0 && (x + y + f) % 3)
+        continue;
+      tb->change_cell(x, y, 'A' + (index * 5 + x + y * 3 + f) % 26,
+                      1 + (index + x + f) % 8, (index * 3 + y + f) % 9);
+    }
+  }
+  tb->set_cursor((index * 11 + f * 5) % w, (index * 3 + f) % h);
+}
+
+/* compares the model with the back buffer and the cursor of 'tb', printing
+ * the first differences */
+static bool compare(struct vt &m, termbox11 *tb, int index, int r, int f,
+                    int cx, int cy) {
+  const int w = tb->width(), h = tb->height();
+  const struct tb_cell *cells = tb->cell_buffer();
+  int bad = 0;
+
+  if (!m.errors.empty()) {
+    fprintf(stderr, "thread %d round %d frame %d: %s\n", index, r, f,
+            m.errors.c_str());
+    bad++;
+  }
+  if (m.w != w || m.h != h) {
+    fprintf(stderr, "thread %d round %d frame %d: model is %dx%d, not %dx%d\n",
+            index, r, f, m.w, m.h, w, h);
+    return false;
+  }
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w; x++) {
+      const struct tb_cell &c = cells[y * w + x];
+      const struct vt_cell &v = m.at(x, y);
+      if (v.ch == c.ch && v.fg == (c.fg & 0x0F) && v.bg == (c.bg & 0x0F))
+        continue;
+      if (bad++ < 5)
+        fprintf(stderr,
+                "thread %d round %d frame %d: cell %d,%d is %c fg %d bg %d, "
+                "want %c fg %d bg %d\n",
+                index, r, f, x, y, v.ch, v.fg, v.bg, c.ch, c.fg & 0x0F,
+                c.bg & 0x0F);
+    }
+  }
+  if (m.cx != cx || m.cy != cy) {
+    fprintf(stderr,
+            "thread %d round %d frame %d: cursor at %d,%d, want %d,%d\n",
+            index, r, f, m.cx, m.cy, cx, cy);
+    bad++;
+  }
+  return bad == 0;
+}
+
+static void worker(int index, int rounds) {
+  for (int r = 0; r < rounds; r++) {
+    struct pane p;
+    p.master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK);
+    if (p.master < 0 || grantpt(p.master) < 0 || unlockpt(p.master) < 0) {
+      perror("posix_openpt");
+      failures++;
+      return;
+    }
+    const int slave = open(ptsname(p.master), O_RDWR | O_NOCTTY);
+    if (slave < 0) {
+      perror("open");
+      failures++;
+      close(p.master);
+      return;
+    }
+    set_size(slave, 80, 24);
+    p.reader = std::thread(drain, &p);
+
+    struct vt m(80, 24);
+    termbox11 *tb = new termbox11(slave);
+    const int w = 40 + (index * 7 + r) % 80, h = 10 + (index + r * 3) % 40;
+    set_size(slave, w, h);
+    raise(SIGWINCH);
+    if (!resized_to(tb, w, h)) {
+      fprintf(stderr, "thread %d round %d: no resize to %dx%d\n", index, r,
+              w, h);
+      failures++;
+    } else {
+      /* the instance clears the screen at its new size once it is drawn
+       * on again */
+      sync(&p, m);
+      m.resize(w, h);
+      tb->clear();
+      for (int f = 0; f < FRAMES; f++) {
+        draw(tb, index, f);
+        tb->present();
+        sync(&p, m);
+        if (!compare(m, tb, index, r, f, (index * 11 + f * 5) % w,
+                     (index * 3 + f) % h)) {
+          failures++;
+          break;
+        }
+      }
+    }
+    /* the instance closes the terminal it was given */
+    delete tb;
+    p.done = true;
+    p.reader.join();
+    close(p.master);
+  }
+}
+
+int main(int argc, char **argv) {
+  const int nthreads = argc > 2 ? atoi(argv[1]) : 4;
+  const int rounds = argc > 2 ? atoi(argv[2]) : 50;
+
+  /* the screen model knows the sequences of xterm */
+  setenv("TERM", "xterm", 1);
+
+  std::thread signals(storm);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nthreads; i++)
+    threads.emplace_back(worker, i, rounds);
+  for (auto &t : threads)
+    t.join();
+  done = true;
+  signals.join();
+
+  printf("%d threads, %d instances each: %s\n", nthreads, rounds,
+         failures ? "FAILED" : "ok");
+  return failures != 0;
+}
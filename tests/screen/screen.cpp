@@ -0,0 +1,477 @@
+/* Differential check of present(): random frame sequences are drawn into a
+ * headless instance, its output is fed to the screen model of vt.h and the
+ * model's grid has to match the back buffer after every frame. Each
+ * scenario runs with the row cache, encoder threads, asynchronous output
+ * and frame pacing as well, which have to send the very same bytes. A few
+ * run again on terminals without background colour erase or REP.
+ * A frame the bandwidth adaptation stepped down to normal mode has to show
+ * the nearest colors of those drawn. Reports the bytes sent per frame and
+ * exits with 1 on any difference.
+ *
+ * usage: screen_test [scenario...]
+ */
+#include "termbox.h"
+#include "vt.h"
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/* what is drawn is named by the part of 'name' before any '/', the rest
+ * names the terminal it is drawn for, see headless_io::term */
+struct scenario {
+  const char *name;
+  int w, h, frames;
+  const char *term;
+};
+
+/* what the terminals the scenarios run on do, for the model, see vt */
+struct terminal {
+  const char *term;
+  bool bce, ech, rep;
+};
+
+static const struct terminal terminals[] = {
+    {"xterm", true, true, true},
+    {"screen", false, false, false},
+    {"rxvt-unicode", true, true, false},
+};
+
+static const struct scenario scenarios[] = {
+    {"sparse", 80, 24, 40, "xterm"},
+    {"full", 80, 24, 15, "xterm"},
+    {"scroll", 100, 30, 30, "xterm"},
+    {"blank", 120, 30, 20, "xterm"},
+    {"runs", 120, 30, 20, "xterm"},
+    {"erase", 100, 30, 20, "xterm"},
+    {"wide", 60, 20, 20, "xterm"},
+    {"modes", 80, 40, 20, "xterm"},
+    {"cursor", 80, 24, 20, "xterm"},
+    {"resize", 80, 24, 12, "xterm"},
+    {"big", 250, 70, 6, "xterm"},
+    {"clear", 100, 30, 20, "xterm"},
+    {"flip", 100, 30, 20, "xterm"},
+    /* neither background colour erase nor ECH nor REP */
+    {"erase/screen", 100, 30, 20, "screen"},
+    {"runs/screen", 120, 30, 20, "screen"},
+    {"scroll/screen", 100, 30, 30, "screen"},
+    /* ECH but no REP */
+    {"runs/rxvt-unicode", 120, 30, 20, "rxvt-unicode"},
+    {"erase/rxvt-unicode", 100, 30, 20, "rxvt-unicode"},
+};
+
+enum config {
+  PLAIN,
+  ROW_CACHE,
+  ENCODE_THREADS,
+  ASYNC_OUTPUT,
+  FRAME_PACING,
+  CONFIGS
+};
+static const char *config_names[] = {"plain", "row cache", "encode threads",
+                                     "async output", "frame pacing"};
+
+static const uint32_t wide_chars[] = {0x4e00, 0x4e8c, 0x4e09, 0x56db, 0x3042};
+static const uint32_t misc_chars[] = {'a',    'b',    'c',    'X',    '#',
+                                      '=',    0x2500, 0x2588, 0x2591, ' ',
+                                      ' ',    ' ',    0xe9};
+
+static uint16_t random_color(std::mt19937 &r, output_mode mode) {
+  switch (mode) {
+  case output_mode::normal:
+    return r() % 9;
+  case output_mode::grayscale:
+    return r() % 26;
+  default:
+    return r() % 256;
+  }
+}
+
+static uint16_t random_attrs(std::mt19937 &r) {
+  uint16_t a = 0;
+  if (r() % 6 == 0)
+    a |= TB_BOLD;
+  if (r() % 8 == 0)
+    a |= TB_UNDERLINE;
+  if (r() % 10 == 0)
+    a |= TB_REVERSE;
+  return a;
+}
+
+/* the colour of the model 'c' is sent as in 'mode', see map_attr() */
+static int model_color(output_mode mode, uint16_t c, bool fg) {
+  int v = c & 0xFF;
+  switch (mode) {
+  case output_mode::mode256:
+    return v ? 1000 + v : 0;
+  case output_mode::mode216:
+    if (v > 215)
+      v = fg ? 7 : 0;
+    return 1000 + v + 0x10;
+  case output_mode::grayscale:
+    if (v > 23)
+      v = fg ? 23 : 0;
+    return 1000 + v + 0xe8;
+  default:
+    return c & 0x0F;
+  }
+}
+
+/* compares the model with the back buffer, printing the first differences */
+static int compare(struct vt &m, termbox11 &tb, output_mode mode,
+                   const char *name, int frame) {
+  const int w = tb.width(), h = tb.height();
+  const struct tb_cell *cells = tb.cell_buffer();
+  int bad = 0;
+
+  if (!m.errors.empty()) {
+    printf("  %s frame %d: %s\n", name, frame, m.errors.c_str());
+    m.errors.clear();
+    bad++;
+  }
+  auto expect = [&](int x, int y, const struct tb_cell &c, uint32_t ch) {
+    const struct vt_cell &v = m.at(x, y);
+    const bool underline = c.fg & TB_UNDERLINE;
+    const bool reverse = (c.fg | c.bg) & TB_REVERSE;
+    /* nothing but the background of a blank shows */
+    bool ok = v.ch == ch && !v.cont &&
+              v.bg == model_color(mode, c.bg, false) && v.reverse == reverse;
+    if (ch != ' ' || underline || reverse)
+      ok = ok && v.fg == model_color(mode, c.fg, true) &&
+           v.bold == !!(c.fg & TB_BOLD) && v.blink == !!(c.bg & TB_BOLD) &&
+           v.underline == underline;
+    if (!ok && bad++ < 5)
+      printf("  %s frame %d: cell %d,%d is %x fg %d bg %d, want %x fg %d bg "
+             "%d\n",
+             name, frame, x, y, v.ch, v.fg, v.bg, ch,
+             model_color(mode, c.fg, true), model_color(mode, c.bg, false));
+  };
+  for (int y = 0; y < h; y++) {
+    for (int x = 0; x < w;) {
+      const struct tb_cell &c = cells[y * w + x];
+      int cw = tb_char_width(c.ch);
+      if (cw < 1)
+        cw = 1;
+      /* a wide character not fitting the line is sent as blanks */
+      if (cw > 1 && x >= w - (cw - 1)) {
+        for (int i = x; i < w; i++)
+          expect(i, y, c, ' ');
+      } else {
+        expect(x, y, c, c.ch ? c.ch : ' ');
+        if (cw == 2 && !m.at(x + 1, y).cont && bad++ < 5)
+          printf("  %s frame %d: cell %d,%d is not the right half of a wide "
+                 "character\n",
+                 name, frame, x + 1, y);
+      }
+      x += cw;
+    }
+  }
+  return bad;
+}
+
+/* draws frame 'f' of 'sc' */
+static void draw(termbox11 &tb, struct vt &m, const struct scenario &sc,
+                 int f, std::mt19937 &r, output_mode *mode,
+                 std::vector<std::vector<struct tb_cell>> &states) {
+  const std::string name(sc.name, strcspn(sc.name, "/"));
+  int w = tb.width(), h = tb.height();
+
+  if (name == "sparse") {
+    for (int k = 0; k < w * h / 100 + 1; k++)
+      tb.change_cell(r() % w, r() % h, misc_chars[r() % 13],
+                     random_color(r, *mode) | random_attrs(r),
+                     random_color(r, *mode));
+  } else if (name == "full" || name == "big") {
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++)
+        tb.change_cell(x, y, 'A' + r() % 26,
+                       random_color(r, *mode) | random_attrs(r),
+                       random_color(r, *mode));
+  } else if (name == "scroll") {
+    /* a log scrolling up by one or three lines, now and then down, under a
+     * fixed status line */
+    struct tb_cell *c = tb.cell_buffer();
+    const int k = f % 3 == 0 ? 3 : 1;
+    if (f % 5 == 4) {
+      memmove(c + w * k, c, sizeof(struct tb_cell) * w * (h - k));
+      for (int i = 0; i < w * k; i++)
+        c[i] = {(uint32_t)('a' + r() % 26), (uint16_t)(r() % 9), 0};
+    } else {
+      memmove(c, c + w * k, sizeof(struct tb_cell) * w * (h - k));
+      for (int y = h - k; y < h; y++)
+        for (int x = 0; x < w; x++)
+          c[y * w + x] = {(uint32_t)(x < 40 ? 'a' + r() % 26 : ' '),
+                          (uint16_t)(r() % 9), 0};
+    }
+    for (int x = 0; x < w; x++)
+      c[(h - 1) * w + x] = {'S', TB_WHITE, TB_BLUE};
+    tb.mark_dirty(0, h);
+  } else if (name == "blank") {
+    tb.clear();
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < (int)(r() % w); x++)
+        tb.change_cell(x, y, 'a' + r() % 26, random_color(r, *mode),
+                       f % 2 ? TB_BLUE : 0);
+  } else if (name == "runs") {
+    for (int y = 0; y < h; y++) {
+      const int n = r() % w;
+      const uint32_t ch = misc_chars[r() % 13];
+      const uint16_t fg = random_color(r, *mode), bg = random_color(r, *mode);
+      for (int x = 0; x < w; x++)
+        tb.change_cell(x, y, x < n ? ch : '.', fg, bg);
+    }
+  } else if (name == "erase") {
+    /* text, then blanks in a colour of their own up to some column or, on
+     * every other row, to the end of the line */
+    for (int y = 0; y < h; y++) {
+      const int a = r() % (w / 2), b = y % 2 ? w : a + r() % (w - a);
+      const uint16_t fg = random_color(r, *mode), bg = random_color(r, *mode);
+      for (int x = 0; x < w; x++) {
+        if (x < a)
+          tb.change_cell(x, y, 'a' + r() % 26, fg, 0);
+        else if (x < b)
+          tb.change_cell(x, y, ' ', fg, bg);
+        else
+          tb.change_cell(x, y, '.', fg, 0);
+      }
+    }
+  } else if (name == "wide") {
+    for (int k = 0; k < 40; k++) {
+      const int x = r() % w, y = r() % h;
+      const uint32_t ch =
+          r() % 2 ? wide_chars[r() % 5] : misc_chars[r() % 13];
+      tb.change_cell(x, y, ch, random_color(r, *mode),
+                     random_color(r, *mode));
+    }
+  } else if (name == "modes") {
+    *mode = (output_mode)(f % 4);
+    tb.select_output_mode(*mode);
+    tb.clear();
+    for (int y = 0; y < h; y++)
+      for (int x = 0; x < w; x++)
+        tb.change_cell(
+            x, y, r() % 3 ? (f % 2 ? 'a' : 'A') + r() % 26 : (f % 2 ? ',' : '.'),
+            (*mode == output_mode::normal ? 1 + r() % 8
+                                          : 1 + random_color(r, *mode)) |
+                random_attrs(r),
+            (*mode == output_mode::normal ? 1 + r() % 8
+                                          : 1 + random_color(r, *mode)) |
+                (r() % 7 == 0 ? TB_BOLD : 0));
+  } else if (name == "cursor") {
+    for (int k = 0; k < 20; k++)
+      tb.change_cell(r() % w, r() % h, 'a' + r() % 26, random_color(r, *mode),
+                     0);
+    if (f % 3 == 0)
+      tb.set_cursor(-1, -1);
+    else
+      tb.set_cursor(r() % w, r() % h);
+  } else if (name == "resize") {
+    w = 40 + r() % 60;
+    h = 10 + r() % 20;
+    tb.resize(w, h);
+    struct tb_event ev;
+    tb.peek_event(&ev, 0);
+    tb.clear();
+    m.resize(w, h);
+    for (int k = 0; k < 200; k++)
+      tb.change_cell(r() % w, r() % h, 'a' + r() % 26, random_color(r, *mode),
+                     random_color(r, *mode));
+  } else if (name == "clear") {
+    tb.clear();
+    for (int y = 0; y < h; y += 2)
+      for (int x = 0; x < w / 3; x++)
+        tb.change_cell(x + (f % 5), y, 'x', TB_GREEN, 0);
+  } else if (name == "flip") {
+    /* three screens shown in turn */
+    struct tb_cell *c = tb.cell_buffer();
+    if (f < 3) {
+      for (int y = 0; y < h; y++)
+        for (int x = 0; x < w; x++)
+          tb.change_cell(x, y, 'A' + r() % 26,
+                         random_color(r, *mode) | random_attrs(r),
+                         random_color(r, *mode));
+      states.emplace_back(c, c + w * h);
+    } else {
+      memcpy(c, states[f % 3].data(), sizeof(struct tb_cell) * w * h);
+      tb.mark_dirty(0, h);
+    }
+  }
+}
+
+static void select_config(termbox11 &tb, enum config cfg) {
+  switch (cfg) {
+  case ROW_CACHE:
+    tb.select_row_cache(256);
+    break;
+  case ENCODE_THREADS:
+    tb.select_encode_threads(4);
+    break;
+  case ASYNC_OUTPUT:
+    tb.select_async_output(true);
+    break;
+  case FRAME_PACING:
+    /* an interval over before the next frame, every frame goes through the
+     * pacer and is sent */
+    tb.select_frame_rate(1000000000);
+    break;
+  default:
+    break;
+  }
+}
+
+/* runs 'sc' in 'cfg', returning the bytes sent and counting the frames
+ * which did not come out right in 'failures' */
+static std::string run(const struct scenario &sc, enum config cfg,
+                       int *failures) {
+  std::string out, all;
+  headless_io io;
+  io.width = sc.w;
+  io.height = sc.h;
+  io.term = sc.term;
+  io.buffer = &out;
+  termbox11 tb(io);
+  select_config(tb, cfg);
+
+  struct vt m(sc.w, sc.h);
+  for (const struct terminal &t : terminals) {
+    if (!strcmp(t.term, sc.term)) {
+      m.bce = t.bce;
+      m.ech = t.ech;
+      m.rep = t.rep;
+    }
+  }
+  std::mt19937 r(1234);
+  output_mode mode = output_mode::normal;
+  std::vector<std::vector<struct tb_cell>> states;
+  for (int f = 0; f < sc.frames; f++) {
+    draw(tb, m, sc, f, r, &mode, states);
+    tb.present();
+    m.feed(out);
+    all += out;
+    out.clear();
+    if (compare(m, tb, mode, sc.name, f))
+      ++*failures;
+  }
+  return all;
+}
+
+/* colors given in a mode and the one of normal mode closest to them */
+struct nearest {
+  output_mode mode;
+  uint16_t color;
+  int normal;
+};
+
+static const struct nearest nearest_colors[] = {
+    {output_mode::mode256, 0, TB_DEFAULT},
+    {output_mode::mode256, 1, TB_RED},
+    {output_mode::mode256, 9, TB_RED},
+    {output_mode::mode256, 12, TB_BLUE},
+    {output_mode::mode256, 16, TB_BLACK},
+    {output_mode::mode256, 21, TB_BLUE},
+    {output_mode::mode256, 46, TB_GREEN},
+    {output_mode::mode256, 51, TB_CYAN},
+    {output_mode::mode256, 94, TB_RED},
+    {output_mode::mode256, 196, TB_RED},
+    {output_mode::mode256, 201, TB_MAGENTA},
+    {output_mode::mode256, 226, TB_YELLOW},
+    {output_mode::mode256, 231, TB_WHITE},
+    {output_mode::mode256, 232, TB_BLACK},
+    {output_mode::mode256, 255, TB_WHITE},
+    {output_mode::mode216, 0, TB_BLACK},
+    {output_mode::mode216, 5, TB_BLUE},
+    {output_mode::mode216, 180, TB_RED},
+    {output_mode::mode216, 215, TB_WHITE},
+    {output_mode::grayscale, 0, TB_BLACK},
+    {output_mode::grayscale, 23, TB_WHITE},
+};
+
+/* steps the output down to normal mode with a link too slow for anything
+ * and checks that a frame of the colors above, a row each, shows the
+ * nearest ones. Returns the number of cells which do not. */
+static int check_degraded(output_mode mode, enum config cfg) {
+  const int w = 40, h = sizeof(nearest_colors) / sizeof(nearest_colors[0]);
+  std::string out;
+  headless_io io;
+  io.width = w;
+  io.height = h;
+  /* every write blocks long enough to be timed */
+  io.output = [&](const char *data, std::size_t len) {
+    out.append(data, len);
+    usleep(2000);
+  };
+  termbox11 tb(io);
+  select_config(tb, cfg);
+  tb.select_output_mode(mode);
+  output_adaptation config;
+  config.max_queue = 1;
+  config.min_rate = UINT64_MAX;
+  config.recover_ms = 60000;
+  tb.select_adaptive_output(true, config);
+
+  /* a first frame to time the link with */
+  struct vt m(w, h);
+  for (int x = 0; x < w; x++)
+    tb.change_cell(x, 0, '-', 0, 0);
+  tb.present();
+  m.feed(out);
+  out.clear();
+
+  for (int y = 0; y < h; y++) {
+    const uint16_t c = nearest_colors[y].mode == mode ? nearest_colors[y].color
+                                                      : 0;
+    for (int x = 0; x < w; x++)
+      tb.change_cell(x, y, 'a' + x % 26, c, c);
+  }
+  tb.present();
+  m.feed(out);
+
+  int bad = 0;
+  for (int y = 0; y < h; y++) {
+    if (nearest_colors[y].mode != mode)
+      continue;
+    const int want = nearest_colors[y].normal;
+    for (int x = 0; x < w; x++) {
+      const struct vt_cell &v = m.at(x, y);
+      if ((v.fg != want || v.bg != want) && bad++ < 5)
+        printf("  degraded %s: color %d is fg %d bg %d, want %d\n",
+               config_names[cfg], nearest_colors[y].color, v.fg, v.bg, want);
+    }
+  }
+  return bad;
+}
+
+int main(int argc, char **argv) {
+  int failures = 0;
+  printf("%-18s %8s %12s\n", "scenario", "frames", "bytes/frame");
+  for (const struct scenario &sc : scenarios) {
+    bool wanted = argc < 2;
+    for (int i = 1; i < argc; i++)
+      wanted = wanted || !strcmp(argv[i], sc.name);
+    if (!wanted)
+      continue;
+
+    const std::string plain = run(sc, PLAIN, &failures);
+    for (int cfg = PLAIN + 1; cfg < CONFIGS; cfg++) {
+      if (run(sc, (enum config)cfg, &failures) != plain) {
+        printf("  %s: the output with %s differs\n", sc.name,
+               config_names[cfg]);
+        failures++;
+      }
+    }
+    printf("%-18s %8d %12.1f\n", sc.name, sc.frames,
+           (double)plain.size() / sc.frames);
+  }
+  /* asynchronous output does not time its writes, the queue it keeps
+   * steps it down */
+  for (int cfg = PLAIN; cfg <= ENCODE_THREADS; cfg++)
+    for (output_mode mode : {output_mode::mode256, output_mode::mode216,
+                             output_mode::grayscale})
+      if (check_degraded(mode, (enum config)cfg))
+        failures++;
+  printf("%s\n", failures ? "FAILED" : "ok");
+  return failures != 0;
+}
@@ -0,0 +1,379 @@
+/* A screen model of the xterm subset termbox sends: cursor motion (CUP,
+ * CUU/CUD/CUF/CUB, CHA, VPA, CR, LF, BS), SGR with 8 and 256 colours, EL,
+ * ED, ECH, REP, scroll regions with SU/SD/IL/DL, autowrap and UTF-8 with
+ * wide characters. It rebuilds the grid a terminal would show from the
+ * bytes it is fed, and notes anything it does not know instead of guessing.
+ */
+#ifndef TESTS_SCREEN_VT_H
+#define TESTS_SCREEN_VT_H
+
+#include "termbox.h"
+#include <algorithm>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+/* colours are 0 for the default, 1 to 8 for SGR 30-37/40-47 and 1000 plus
+ * the index for 38;5/48;5 */
+struct vt_cell {
+  uint32_t ch{' '};
+  int fg{0};
+  int bg{0};
+  bool bold{false};
+  bool underline{false};
+  bool blink{false};
+  bool reverse{false};
+  /* right half of a wide character */
+  bool cont{false};
+};
+
+struct vt {
+  int w, h;
+  std::vector<vt_cell> grid;
+  int cx{0};
+  int cy{0};
+  /* the last column was written, the next character wraps */
+  bool wrap{false};
+  int top{0};
+  int bottom;
+  vt_cell pen{};
+  /* erasing takes the current background, as xterm does */
+  bool bce{true};
+  /* ECH and REP are understood, as by xterm; elsewhere they are errors */
+  bool ech{true};
+  bool rep{true};
+  uint32_t last_ch{' '};
+  std::string pending;
+  /* what could not be interpreted, empty if all went well */
+  std::string errors;
+
+  vt(int width, int height)
+      : w(width), h(height), grid(width * height), bottom(height - 1) {}
+
+  vt_cell &at(int x, int y) { return grid[y * w + x]; }
+
+  void resize(int width, int height) {
+    std::vector<vt_cell> g(width * height);
+    for (int y = 0; y < height && y < h; y++)
+      for (int x = 0; x < width && x < w; x++)
+        g[y * width + x] = grid[y * w + x];
+    grid.swap(g);
+    w = width;
+    h = height;
+    top = 0;
+    bottom = h - 1;
+    if (cx >= w)
+      cx = w - 1;
+    if (cy >= h)
+      cy = h - 1;
+  }
+
+  vt_cell blank() const {
+    vt_cell c;
+    if (bce)
+      c.bg = pen.bg;
+    return c;
+  }
+
+  void scroll_up(int t, int b, int n) {
+    for (int k = 0; k < n; k++) {
+      for (int y = t; y < b; y++)
+        for (int x = 0; x < w; x++)
+          at(x, y) = at(x, y + 1);
+      for (int x = 0; x < w; x++)
+        at(x, b) = blank();
+    }
+  }
+
+  void scroll_down(int t, int b, int n) {
+    for (int k = 0; k < n; k++) {
+      for (int y = b; y > t; y--)
+        for (int x = 0; x < w; x++)
+          at(x, y) = at(x, y - 1);
+      for (int x = 0; x < w; x++)
+        at(x, t) = blank();
+    }
+  }
+
+  void line_feed() {
+    if (cy == bottom)
+      scroll_up(top, bottom, 1);
+    else if (cy < h - 1)
+      cy++;
+  }
+
+  void put(uint32_t ch) {
+    int cw = tb_char_width(ch);
+    if (cw < 1)
+      cw = 1;
+    if (wrap) {
+      cx = 0;
+      line_feed();
+      wrap = false;
+    }
+    if (cw == 2 && cx == w - 1) {
+      at(cx, cy) = blank();
+      cx = 0;
+      line_feed();
+    }
+    vt_cell c = pen;
+    c.ch = ch;
+    at(cx, cy) = c;
+    if (cw == 2) {
+      c.ch = 0;
+      c.cont = true;
+      at(cx + 1, cy) = c;
+    }
+    last_ch = ch;
+    if (cx + cw >= w) {
+      cx = w - 1;
+      wrap = true;
+    } else {
+      cx += cw;
+    }
+  }
+
+  void sgr(std::vector<int> &p) {
+    if (p.empty())
+      p.push_back(0);
+    for (size_t i = 0; i < p.size(); i++) {
+      const int v = p[i];
+      if (v == 0)
+        pen = vt_cell();
+      else if (v == 1)
+        pen.bold = true;
+      else if (v == 4)
+        pen.underline = true;
+      else if (v == 5)
+        pen.blink = true;
+      else if (v == 7)
+        pen.reverse = true;
+      else if (v == 22)
+        pen.bold = false;
+      else if (v == 24)
+        pen.underline = false;
+      else if (v == 25)
+        pen.blink = false;
+      else if (v == 27)
+        pen.reverse = false;
+      else if (v == 10)
+        ; /* primary font */
+      else if (v >= 30 && v <= 37)
+        pen.fg = v - 30 + 1;
+      else if (v == 39)
+        pen.fg = 0;
+      else if (v >= 40 && v <= 47)
+        pen.bg = v - 40 + 1;
+      else if (v == 49)
+        pen.bg = 0;
+      else if ((v == 38 || v == 48) && i + 2 < p.size() && p[i + 1] == 5) {
+        (v == 38 ? pen.fg : pen.bg) = 1000 + p[i + 2];
+        i += 2;
+      } else
+        errors += "SGR " + std::to_string(v) + "; ";
+    }
+  }
+
+  void csi(const std::string &s) {
+    const char fin = s.back();
+    std::string body = s.substr(0, s.size() - 1);
+    const bool priv = !body.empty() && (body[0] == '?' || body[0] == '>');
+    bool inter = false;
+    if (!body.empty() && (body.back() == '$' || body.back() == ' ')) {
+      inter = true;
+      body.pop_back();
+    }
+    if (priv)
+      body.erase(0, 1);
+
+    std::vector<int> p;
+    int cur = -1;
+    for (char c : body) {
+      if (c >= '0' && c <= '9') {
+        cur = (cur < 0 ? 0 : cur * 10) + (c - '0');
+      } else if (c == ';') {
+        p.push_back(cur < 0 ? 0 : cur);
+        cur = -1;
+      }
+    }
+    if (cur >= 0 || !body.empty())
+      p.push_back(cur < 0 ? 0 : cur);
+    auto arg = [&](size_t i, int d) { return p.size() > i && p[i] ? p[i] : d; };
+
+    /* the alternate screen starts out blank, other modes do not matter */
+    if (priv) {
+      if ((fin == 'h' || fin == 'l') && !p.empty() && p[0] == 1049)
+        for (auto &c : grid)
+          c = vt_cell();
+      return;
+    }
+    if (inter)
+      return;
+
+    switch (fin) {
+    case 'H':
+    case 'f':
+      cy = std::min(arg(0, 1), h) - 1;
+      cx = std::min(arg(1, 1), w) - 1;
+      wrap = false;
+      break;
+    case 'A':
+      cy = std::max(cy - arg(0, 1), 0);
+      wrap = false;
+      break;
+    case 'B':
+      cy = std::min(cy + arg(0, 1), h - 1);
+      wrap = false;
+      break;
+    case 'C':
+      cx = std::min(cx + arg(0, 1), w - 1);
+      wrap = false;
+      break;
+    case 'D':
+      cx = std::max(cx - arg(0, 1), 0);
+      wrap = false;
+      break;
+    case 'G':
+    case '`':
+      cx = std::min(arg(0, 1), w) - 1;
+      wrap = false;
+      break;
+    case 'd':
+      cy = std::min(arg(0, 1), h) - 1;
+      wrap = false;
+      break;
+    case 'm':
+      sgr(p);
+      break;
+    case 'K': {
+      const int m = arg(0, 0);
+      const int a = m == 0 ? cx : 0, b = m == 1 ? cx : w - 1;
+      for (int x = a; x <= b; x++)
+        at(x, cy) = blank();
+      wrap = false;
+      break;
+    }
+    case 'X':
+      if (!ech) {
+        errors += "ECH; ";
+        break;
+      }
+      for (int x = cx; x < cx + arg(0, 1) && x < w; x++)
+        at(x, cy) = blank();
+      wrap = false;
+      break;
+    case 'J':
+      if (arg(0, 0) == 2) {
+        for (auto &c : grid)
+          c = blank();
+      } else if (arg(0, 0) == 0) {
+        for (int i = cy * w + cx; i < w * h; i++)
+          grid[i] = blank();
+      } else {
+        errors += "ED " + std::to_string(arg(0, 0)) + "; ";
+      }
+      break;
+    case 'b':
+      if (!rep) {
+        errors += "REP; ";
+        break;
+      }
+      for (int i = arg(0, 1); i > 0; i--)
+        put(last_ch);
+      break;
+    case 'r':
+      top = arg(0, 1) - 1;
+      bottom = std::min(arg(1, h), h) - 1;
+      cx = cy = 0;
+      wrap = false;
+      break;
+    case 'S':
+      scroll_up(top, bottom, arg(0, 1));
+      break;
+    case 'T':
+      scroll_down(top, bottom, arg(0, 1));
+      break;
+    case 'L':
+    case 'M':
+      if (cy >= top && cy <= bottom) {
+        if (fin == 'L')
+          scroll_down(cy, bottom, arg(0, 1));
+        else
+          scroll_up(cy, bottom, arg(0, 1));
+      }
+      cx = 0;
+      wrap = false;
+      break;
+    case 'c':
+    case 'h':
+    case 'l':
+    case 't':
+      break;
+    default:
+      errors += std::string("CSI ") + fin + "; ";
+    }
+  }
+
+  /* interprets 'data', keeping an incomplete sequence at its end for the
+   * next call */
+  void feed(const std::string &data) {
+    pending += data;
+    const std::string &s = pending;
+    size_t i = 0;
+    while (i < s.size()) {
+      const unsigned char c = s[i];
+      if (c == 0x1b) {
+        if (i + 1 >= s.size())
+          break;
+        const char n = s[i + 1];
+        if (n == '[') {
+          size_t j = i + 2;
+          while (j < s.size() && !(s[j] >= 0x40 && s[j] <= 0x7e))
+            j++;
+          if (j >= s.size())
+            break;
+          csi(s.substr(i + 2, j - i - 1));
+          i = j + 1;
+        } else if (n == '(' || n == ')') {
+          if (i + 2 >= s.size())
+            break;
+          i += 3;
+        } else if (n == '7' || n == '8' || n == '=' || n == '>') {
+          i += 2;
+        } else {
+          errors += std::string("ESC ") + n + "; ";
+          i += 2;
+        }
+      } else if (c == '\r') {
+        cx = 0;
+        wrap = false;
+        i++;
+      } else if (c == '\n') {
+        line_feed();
+        wrap = false;
+        i++;
+      } else if (c == '\b') {
+        if (cx > 0)
+          cx--;
+        wrap = false;
+        i++;
+      } else if (c == 0x07 || c == 0x0e || c == 0x0f) {
+        i++;
+      } else if (c < 0x20) {
+        errors += "control " + std::to_string(c) + "; ";
+        i++;
+      } else {
+        const int len = tb_utf8_char_length(c);
+        if (i + len > s.size())
+          break;
+        uint32_t ch;
+        tb_utf8_char_to_unicode(&ch, s.data() + i);
+        put(ch);
+        i += len;
+      }
+    }
+    pending.erase(0, i);
+  }
+};
+
+#endif /* TESTS_SCREEN_VT_H */